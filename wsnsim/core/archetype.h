@@ -0,0 +1,159 @@
+#pragma once
+
+#include "wsnsim.h"
+#include <new>
+#include <shared_mutex>
+
+
+namespace wsn {
+
+
+
+	// stores the nodes of one generic_node type and each of their components in contiguous columns,
+	// so that systems can update e.g. all batteries in storage order. nodes made here are ordinary
+	// nodes of the network: the per-node API is unchanged
+	//
+	//	archetype<my_node> storage;
+	//	storage.new_node(network, "n1", location(0, 0, 0));
+	//	...
+	//	storage.run_system([&]() {
+	//		storage.each_battery([&](auto& b) { ... });
+	//	});
+	template <typename node_type>
+	class archetype : public entity_storage {
+	protected:
+		template <typename type>
+		class column {
+		protected:
+			using storage_type = std::aligned_storage_t<sizeof(type), alignof(type)>;
+
+			struct chunk {
+				std::unique_ptr<storage_type[]> slots;
+				std::unique_ptr<bool[]> live;
+				std::shared_ptr<std::shared_mutex> churn;
+				uint used = 0;
+
+				chunk(uint size, std::shared_ptr<std::shared_mutex> _churn)
+					: slots(new storage_type[size]), live(new bool[size]()), churn(std::move(_churn))
+				{
+				}
+			};
+
+			uint chunk_size;
+			std::vector<std::shared_ptr<chunk>> chunks;	// chunks also live as long as the entities in them
+
+		public:
+			column(uint _chunk_size)
+				: chunk_size(_chunk_size)
+			{
+			}
+
+			void allocate(slot& result, const std::shared_ptr<std::shared_mutex>& churn) {
+				std::unique_lock lock(*churn);
+
+				if (chunks.empty() || chunks.back()->used == chunk_size)
+					chunks.push_back(std::make_shared<chunk>(chunk_size, churn));
+
+				auto& c = chunks.back();
+				auto i = c->used++;
+				result.memory = &c->slots[i];
+				result.live = &c->live[i];
+				result.churn = churn.get();
+				result.owner = c;
+			}
+
+			template <typename Function>
+			void each(Function callback) {
+				for (auto& c : chunks) {
+					for (uint i = 0; i < c->used; i++) {
+						if (c->live[i]) callback(*std::launder(reinterpret_cast<type*>(&c->slots[i])));
+					}
+				}
+			}
+		};
+
+		using comm_type = typename node_type::comm_component_type;
+		using sensor_type = typename node_type::sensor_component_type;
+		using battery_type = typename node_type::battery_component_type;
+		using power_type = typename node_type::power_component_type;
+		using controller_type = typename node_type::controller_component_type;
+
+		column<node_type> nodes;
+		column<comm_type> comms;
+		column<sensor_type> sensors;
+		column<battery_type> batteries;
+		column<power_type> powers;
+		column<controller_type> controllers;
+
+		// held exclusively while entities are added to the columns or marked dead, shared by systems
+		std::shared_ptr<std::shared_mutex> churn = std::make_shared<std::shared_mutex>();
+
+		bool allocate(const std::type_info& type, slot& result) override {
+			if (type == typeid(node_type)) nodes.allocate(result, churn);
+			else if (type == typeid(comm_type)) comms.allocate(result, churn);
+			else if (type == typeid(sensor_type)) sensors.allocate(result, churn);
+			else if (type == typeid(battery_type)) batteries.allocate(result, churn);
+			else if (type == typeid(power_type)) powers.allocate(result, churn);
+			else if (type == typeid(controller_type)) controllers.allocate(result, churn);
+			else return false;
+
+			return true;
+		}
+
+	public:
+		archetype(uint chunk_size = 256)
+			: nodes(chunk_size), comms(chunk_size), sensors(chunk_size),
+			batteries(chunk_size), powers(chunk_size), controllers(chunk_size)
+		{
+		}
+
+		// same as network->new_node<node_type>(args...), with the node and its components stored here
+		template <class... Targs>
+		std::shared_ptr<node_type> new_node(std::shared_ptr<basic_network> network, Targs... args) {
+			scope scope(this);
+			return network->template new_node<node_type>(std::forward<Targs>(args)...);
+		}
+
+		// runs a system: no node of this archetype is created or destroyed until it returns, so what
+		// the each_ calls hand out stays valid throughout, e.g. gathered into a battery::batch.
+		// churn from other threads waits, the system itself must not add nor drop nodes here
+		template <typename Function>
+		void run_system(Function system) {
+			std::shared_lock lock(*churn);
+			system();
+		}
+
+		// systems: callbacks get the live entities of a column in storage order, statically typed.
+		// to be called from run_system
+		template <typename Function>
+		void each_node(Function callback) {
+			nodes.each(callback);
+		}
+
+		template <typename Function>
+		void each_comm(Function callback) {
+			comms.each(callback);
+		}
+
+		template <typename Function>
+		void each_sensor(Function callback) {
+			sensors.each(callback);
+		}
+
+		template <typename Function>
+		void each_battery(Function callback) {
+			batteries.each(callback);
+		}
+
+		template <typename Function>
+		void each_power(Function callback) {
+			powers.each(callback);
+		}
+
+		template <typename Function>
+		void each_controller(Function callback) {
+			controllers.each(callback);
+		}
+	};
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "wsnsim.h"
+#include <map>
 
 
 namespace wsn::battery {
@@ -30,6 +31,10 @@ namespace wsn::battery {
 		double get_max_capacity() const override {
 			return 1.;
 		}
+
+		double predict_time_to(double soc, double = 1., const harvest_profile& = nullptr) const override {
+			return soc == get_soc() ? 0. : std::numeric_limits<double>::infinity();
+		}
 	};
 
 
@@ -39,6 +44,14 @@ namespace wsn::battery {
 		double minl, maxl, level;
 		double charge_rate, consume_rate;
 
+		// lazy mode: level is the level at the clock time stamp, moving at rate since then
+		bool lazy = false;
+		bool charging = false, consuming = false;
+		double stamp = 0, rate = 0;
+		uint crossing = 0;
+
+		template <typename> friend class batch;
+
 	public:
 		linear() {
 			minl = 0;
@@ -48,66 +61,134 @@ namespace wsn::battery {
 		}
 
 		bool charge(double T) override {
-			if (level >= maxl) return false;
+			if (lazy) settle();
+			bool r = step_charge(T);
+			if (lazy) rearm();
+			return r;
+		}
 
-			auto power = get_node()->get_power();
-			double effective_rate = std::min(charge_rate, power->get_max_power());
+		bool consume(double T) override {
+			if (lazy) settle();
+			bool r = step_consume(T);
+			if (lazy) rearm();
+			return r;
+		}
 
-			double last_level = level;
-			level += T * effective_rate;
-			if (level == last_level) return false;
+		double get_norminal_voltage() const override {
+			return 1.5;
+		}
 
-			if (level >= maxl) {
-				level = maxl;
-				fire(event_charge, level - last_level);
-				fire(event_full);
-				return true;
+		double get_capacity() const override {
+			return get_level();
+		}
+
+		double get_max_capacity() const override {
+			return maxl;
+		}
+
+		// exact without harvest, otherwise the harvest is taken constant over each prediction step
+		double predict_time_to(double soc, double load = 1., const harvest_profile& harvest = nullptr) const override {
+			double target = std::clamp(soc * maxl, minl, maxl), l = get_level();
+			double drain = load * consume_rate;
+			if (target == l) return 0.;
+
+			if (!harvest)
+				return target < l && drain > 0 ? (l - target) / drain : std::numeric_limits<double>::infinity();
+
+			double supply = std::min(charge_rate, get_node_ref().get_power()->get_max_power());
+
+			for (double t = 0; t < prediction_horizon; t += prediction_step) {
+				double r = supply * std::clamp(harvest(t), 0., 1.) - drain;
+				double next = std::clamp(l + r * prediction_step, minl, maxl);
+				if ((next - target) * (l - target) <= 0 && next != l) return t + (target - l) / r;
+				l = next;
 			}
 
-			fire(event_charge, level - last_level);
-			return true;
+			return std::numeric_limits<double>::infinity();
 		}
 
-		bool consume(double T) override {
-			if (level <= minl) return false;
+		void start() override {
+			basic_battery::start();
+			if (lazy) {
+				stamp = get_world_clock_time();
+				rearm();
+			}
+		}
 
-			double last_level = level;
-			level -= T * consume_rate;
-			if (level == last_level) return false;
+		void stop() override {
+			if (lazy) {
+				settle();
+				stop_timer(crossing);
+				crossing = 0;
+				rate = 0;
+			}
+			basic_battery::stop();
+		}
 
-			if (level <= minl) {
-				level = minl;
-				fire(event_consume, last_level - level);
-				fire(event_empty);
-				return false;
+
+
+		// in lazy mode the battery is not advanced by charge(T)/consume(T) on a timer: it follows the
+		// load set with set_load between its changes, is evaluated on query, and arms a single timer
+		// for the predicted full or empty crossing. charge(T)/consume(T) still add one-off amounts.
+		// the charge rate is capped by the power source when the load changes, update() samples it again
+		void set_lazy(bool l) {
+			if (lazy == l) return;
+
+			settle();
+			if (crossing) {
+				stop_timer(crossing);
+				crossing = 0;
 			}
 
-			fire(event_consume, last_level - level);
-			return true;
+			lazy = l;
+			rate = 0;
+			if (is_started()) stamp = get_world_clock_time();
+			rearm();
 		}
 
-		double get_norminal_voltage() const override {
-			return 1.5;
+		bool is_lazy() const {
+			return lazy;
 		}
 
-		double get_capacity() const override {
-			return level;
+		void set_load(bool _charging, bool _consuming) {
+			settle();
+			charging = _charging;
+			consuming = _consuming;
+			rearm();
 		}
 
-		double get_max_capacity() const override {
-			return maxl;
+		bool is_charging() const {
+			return charging;
+		}
+
+		bool is_consuming() const {
+			return consuming;
+		}
+
+		void update() {
+			settle();
+			rearm();
+		}
+
+		// net rate of the level in lazy mode
+		double get_rate() const {
+			return rate;
 		}
 
 
 
 		void set_min_level(double _minl) {
+			settle();
 			minl = _minl;
 			if (level < minl) level = minl;
+			rearm();
 		}
 
 		void set_max_level(double _maxl) {
+			settle();
 			maxl = _maxl;
 			if (level > maxl) level = maxl;
+			rearm();
 		}
 
 		double get_min_level() const {
@@ -119,11 +200,16 @@ namespace wsn::battery {
 		}
 
 		double get_level() const {
-			return level;
+			if (!lazy || rate == 0) return level;
+
+			double l = level + rate * (get_world_clock_time() - stamp);
+			return std::clamp(l, minl, maxl);
 		}
 
 		void set_level(double l) {
+			settle();
 			level = l;
+			rearm();
 		}
 
 		void set_level_delta(double dl) {
@@ -141,51 +227,341 @@ namespace wsn::battery {
 		}
 
 		void set_charge_rate(double r) {
+			settle();
 			charge_rate = r;
+			rearm();
 		}
 
 		void set_consume_rate(double r) {
+			settle();
 			consume_rate = r;
+			rearm();
 		}
 
 		void set_rates(double charge, double consume) {
+			settle();
 			charge_rate = charge;
 			consume_rate = consume;
+			rearm();
+		}
+
+	protected:
+		bool step_charge(double T) {
+			if (level >= maxl) return false;
+
+			auto& power = get_node_ref().get_power();
+			double effective_rate = std::min(charge_rate, power->get_max_power());
+
+			double last_level = level;
+			level += T * effective_rate;
+			if (level == last_level) return false;
+
+			if (level >= maxl) {
+				level = maxl;
+				fire(event_charge, level - last_level);
+				fire(event_full);
+				return true;
+			}
+
+			fire(event_charge, level - last_level);
+			return true;
+		}
+
+		bool step_consume(double T) {
+			if (level <= minl) return false;
+
+			double last_level = level;
+			level -= T * consume_rate;
+			if (level == last_level) return false;
+
+			if (level <= minl) {
+				level = minl;
+				fire(event_consume, last_level - level);
+				fire(event_empty);
+				return false;
+			}
+
+			fire(event_consume, last_level - level);
+			return true;
+		}
+
+		bool deplete() override {
+			settle();
+			if (level <= minl) return false;
+
+			double last_level = level;
+			level = minl;
+			fire(event_consume, last_level - level);
+			rearm();
+			return true;
+		}
+
+		// brings level up to now, reporting what moved since the last change
+		void settle() {
+			if (!lazy || !is_started()) return;
+
+			double now = get_world_clock_time();
+			double last_level = level;
+			level = get_level();
+			stamp = now;
+
+			if (level > last_level) fire(event_charge, level - last_level);
+			else if (level < last_level) fire(event_consume, last_level - level);
+		}
+
+		// with level settled: the rate of the current load and the timer of the next crossing
+		void rearm() {
+			if (!lazy) return;
+
+			if (crossing) {
+				stop_timer(crossing);
+				crossing = 0;
+			}
+
+			rate = 0;
+			if (!is_started()) return;
+
+			double net = 0;
+			if (charging) net += std::min(charge_rate, get_node_ref().get_power()->get_max_power());
+			if (consuming) net -= consume_rate;
+
+			// held at a bound the net load pushes it against, as the steps do
+			if ((net > 0 && level >= maxl) || (net < 0 && level <= minl)) net = 0;
+			rate = net;
+			if (rate == 0) return;
+
+			bool filling = rate > 0;
+			double dt = ((filling ? maxl : minl) - level) / rate;
+
+			crossing = timer_once(std::chrono::duration<double>(std::max(0., dt)), false, [this, filling](event&) {
+				crossing = 0;
+				settle();
+				level = filling ? maxl : minl;
+				fire(filling ? event_full : event_empty);
+				rearm();
+			});
+		}
+	};
+
+
+
+	enum class chemistry : uchar {
+		lithium,
+		nikel_cadminum,
+		nikel_mh
+	};
+
+	// coefficients of a chemistry's discharge model, for a depth of discharge q and a current I:
+	// U = 1.164 U_nom - alpha Qmax q / (Qmax - q) + beta exp(-26.5487 q) - (r0 + gamma Qmax / (Qmax - q)) I
+	struct coefficients {
+		double capacity, alpha, beta, gamma, r0;
+	};
+
+	template <chemistry type>
+	struct model;
+
+	template <>
+	struct model<chemistry::lithium> {
+		static coefficients get(double U_nom, double Q_rated) {
+			return { 1., 0.076, 3.5653, 0.076, (U_nom / Q_rated) / 100 };
+		}
+	};
+
+	// the Nikel_Cadmium model of anh Phuong/battery only differs from lithium by its capacity
+	template <>
+	struct model<chemistry::nikel_cadminum> {
+		static coefficients get(double U_nom, double Q_rated) {
+			return { 1.1364, 0.076, 3.5653, 0.076, (U_nom / Q_rated) / 100 };
+		}
+	};
+
+	// Nikel_MH::getEdischarge of anh Phuong/battery
+	template <>
+	struct model<chemistry::nikel_mh> {
+		static coefficients get(double, double) {
+			return { 1.07692, 0., 0.26422, 0.0152, 0.01 };
+		}
+	};
+
+
+
+	// time for the depth of discharge to go from 0 to q under a constant load, with the voltage on the way,
+	// tabulated once for all the batteries sharing a chemistry and parameters. evolving a battery is then
+	// a lookup of its time, a shift by T and the inverse lookup. sign is 1 when discharging, -1 when charging
+	class discharge_table {
+	protected:
+		std::vector<double> q, t, g;	// g = dt/dq, for Hermite interpolation
+		double R_load;
+
+		size_t cell_of(const std::vector<double>& v, double x) const {
+			auto itr = std::upper_bound(v.begin(), v.end(), x);
+			size_t i = itr - v.begin();
+			return i == 0 ? 0 : std::min(i - 1, v.size() - 2);
+		}
+
+		double hermite(size_t i, double x) const {
+			double h = q[i + 1] - q[i], s = (x - q[i]) / h, s2 = s * s, s3 = s2 * s;
+			return (2 * s3 - 3 * s2 + 1) * t[i] + (s3 - 2 * s2 + s) * h * g[i] + (-2 * s3 + 3 * s2) * t[i + 1] + (s3 - s2) * h * g[i + 1];
 		}
 
+	public:
+		// current the load settles to at a depth of discharge, nan where the model has none
+		static double current(const coefficients& c, double U_nom, double R_load, double Qmax, double q, int sign) {
+			double k = Qmax / (Qmax - q);
+			double I = (1.164 * U_nom - c.alpha * k * q + c.beta * exp(-26.5487 * q)) / (R_load + sign * (c.r0 + c.gamma * k));
+			return I > 0 ? I : std::numeric_limits<double>::quiet_NaN();
+		}
+
+		discharge_table(const coefficients& c, double U_nom, double _R_load, double Qmax, int sign, double resolution = 0.01)
+			: R_load(_R_load)
+		{
+			auto gradient = [&](double x) {
+				return 3600 / current(c, U_nom, R_load, Qmax, x, sign);
+			};
+
+			q.push_back(0);
+			t.push_back(0);
+			g.push_back(gradient(0));
+
+			// cells in which dt/dq changes by at most the resolution: dense where the exponential term
+			// moves fast and toward the stall, where the current fades out
+			double h = Qmax * 1e-6;
+			while (h > Qmax * 1e-12 && q.size() < 1000000) {
+				double x = q.back() + h;
+				double gm = gradient(q.back() + h / 2), gx = gradient(x);
+
+				if (x >= Qmax || !std::isfinite(gm) || !std::isfinite(gx) || std::abs(gx - g.back()) > resolution * g.back()) {
+					h /= 2;
+					continue;
+				}
+
+				t.push_back(t.back() + h / 6 * (g.back() + 4 * gm + gx));
+				q.push_back(x);
+				g.push_back(gx);
+
+				if (std::abs(gx - g[g.size() - 2]) < resolution * gx / 4) h *= 2;
+			}
+		}
+
+		// where the table ends: the model stalls before Qmax
+		double get_max_depth() const {
+			return q.back();
+		}
+
+		double get_max_time() const {
+			return t.back();
+		}
+
+		bool empty() const {
+			return q.size() < 2;
+		}
+
+		double time_at(double x) const {
+			return hermite(cell_of(q, x), x);
+		}
+
+		double depth_at(double time) const {
+			auto i = cell_of(t, time);
+
+			// Newton on the cell's cubic, from the linear guess
+			double x = q[i] + (time - t[i]) / (t[i + 1] - t[i]) * (q[i + 1] - q[i]);
+			for (int k = 0; k < 3; k++) {
+				double h = q[i + 1] - q[i], s = (x - q[i]) / h, s2 = s * s;
+				double d = ((6 * s2 - 6 * s) * (t[i] - t[i + 1])) / h + (3 * s2 - 4 * s + 1) * g[i] + (3 * s2 - 2 * s) * g[i + 1];
+				x -= (hermite(i, x) - time) / d;
+			}
+
+			return std::clamp(x, q[i], q[i + 1]);
+		}
+
+		double voltage_at(double x) const {
+			auto i = cell_of(q, x);
+			double s = (x - q[i]) / (q[i + 1] - q[i]);
+			return R_load * 3600 * ((1 - s) / g[i] + s / g[i + 1]);
+		}
+
+		// shared by all the batteries with the same parameters, built on first use
+		static std::shared_ptr<const discharge_table> get(chemistry type, double U_nom, double R_load, double Q_rated, double Qmax, int sign, const coefficients& c) {
+			using key_type = std::tuple<chemistry, double, double, double, int>;
+			static std::mutex mutex;
+			static std::map<key_type, std::shared_ptr<const discharge_table>> tables;
+
+			std::lock_guard lock(mutex);
+			auto& table = tables[key_type(type, U_nom, R_load, Q_rated, sign)];
+			if (!table) table = std::make_shared<discharge_table>(c, U_nom, R_load, Qmax, sign);
+			return table;
+		}
 	};
 
 
 
 	class chemical : public basic_battery {
 	public:
-		enum class battery_type : uchar {
-			lithium,
-			nikel_cadminum,
-			nikel_mh
-		};
+		using battery_type = chemistry;
 
 	protected:
 		// parameters
 		battery_type type;
-		double R_load, U_battnorm, Q_rated, dt;
+		double R_load, U_battnorm, Q_rated, dt, tolerance;
+		bool use_tables;
+		coefficients coef;
+		mutable std::shared_ptr<const discharge_table> tables[2];	// discharging, charging
 
 		// states
-		double Qdt, Qmax;
+		double Qdt, Qmax, step_size;
+
+		template <typename> friend class batch;
+
+		void update_model() {
+			switch (type) {
+			case battery_type::lithium:
+				coef = model<battery_type::lithium>::get(U_battnorm, Q_rated);
+				break;
+			case battery_type::nikel_cadminum:
+				coef = model<battery_type::nikel_cadminum>::get(U_battnorm, Q_rated);
+				break;
+			case battery_type::nikel_mh:
+				coef = model<battery_type::nikel_mh>::get(U_battnorm, Q_rated);
+				break;
+			}
+
+			Qmax = coef.capacity * Q_rated;
+			tables[0] = tables[1] = nullptr;
+		}
+
+		const discharge_table& get_table(int sign) const {
+			auto& table = tables[sign > 0 ? 0 : 1];
+			if (!table) table = discharge_table::get(type, U_battnorm, R_load, Q_rated, Qmax, sign, coef);
+			return *table;
+		}
 
 	public:
 		chemical() {
 			type = battery_type::lithium;
-			set_norminal_voltage(1.5);
-			set_load(1);
-			set_rated_capacity(6500);
+			U_battnorm = 1.5;
+			R_load = 1;
+			Q_rated = 6500;
 			dt = 0.01;
+			tolerance = 1e-9;
+			use_tables = true;
 
 			Qdt = 0;
+			step_size = dt;
+			update_model();
+		}
+
+		void set_type(battery_type t) {
+			type = t;
+			update_model();
+		}
+
+		battery_type get_type() const {
+			return type;
 		}
 
 		void set_load(double r) {
 			R_load = r;
+			tables[0] = tables[1] = nullptr;
 		}
 
 		double get_load() const {
@@ -194,6 +570,7 @@ namespace wsn::battery {
 
 		void set_norminal_voltage(double nv) {
 			U_battnorm = nv;
+			update_model();
 		}
 
 		double get_norminal_voltage() const override {
@@ -202,18 +579,7 @@ namespace wsn::battery {
 
 		void set_rated_capacity(double c) {
 			Q_rated = c;
-
-			switch (type) {
-			case battery_type::lithium:
-				Qmax = Q_rated;
-				break;
-			case battery_type::nikel_cadminum:
-				Qmax = 1.1364 * Q_rated;
-				break;
-			case battery_type::nikel_mh:
-				Qmax = 1.07692 * Q_rated;
-				break;
-			}
+			update_model();
 		}
 
 		double set_rated_capacity() const {
@@ -240,6 +606,63 @@ namespace wsn::battery {
 			return 1. - Qdt / Qmax;
 		}
 
+		// without harvest, a difference of times in the discharge table. with harvest, Runge-Kutta steps
+		// over the net current, bisected in the step of the crossing
+		double predict_time_to(double soc, double load = 1., const harvest_profile& harvest = nullptr) const override {
+			double target = (1. - std::clamp(soc, 0., 1.)) * Qmax;
+			const double never = std::numeric_limits<double>::infinity();
+			if (target == Qdt) return 0.;
+
+			if (!harvest) {
+				if (target < Qdt || load <= 0) return never;
+
+				// past the end of the table the model stalls
+				auto& table = get_table(1);
+				if (!table.empty() && Qdt <= table.get_max_depth())
+					return target <= table.get_max_depth() ? (table.time_at(target) - table.time_at(Qdt)) / load : never;
+			}
+
+			auto f = [&](double t, double q) {
+				double h = harvest ? std::clamp(harvest(t), 0., 1.) : 0.;
+				double d = load * current(q, 1);
+				if (h > 0) d -= h * current(q, -1);
+				return d / 3600;
+			};
+
+			// from q at t over h
+			auto advance = [&](double t, double q, double h) {
+				double k1 = f(t, q), k2 = f(t + h / 2, q + h / 2 * k1), k3 = f(t + h / 2, q + h / 2 * k2), k4 = f(t + h, q + h * k3);
+				return std::clamp(q + h * (k1 + 2 * k2 + 2 * k3 + k4) / 6, 0., Qmax);
+			};
+
+			double q = Qdt;
+			for (double t = 0; t < prediction_horizon; t += prediction_step) {
+				double next = advance(t, q, prediction_step);
+				if (!std::isfinite(next)) return never;
+
+				if ((next - target) * (q - target) <= 0 && next != q) {
+					double lo = 0, hi = prediction_step;
+					for (int i = 0; i < 40; i++) {
+						double mid = (lo + hi) / 2, x = advance(t, q, mid);
+						if ((x - target) * (q - target) > 0) lo = mid;
+						else hi = mid;
+					}
+					return t + hi;
+				}
+
+				q = next;
+			}
+
+			return never;
+		}
+
+		// voltage across the load while discharging
+		double get_voltage() const {
+			auto& table = get_table(1);
+			if (!table.empty() && Qdt <= table.get_max_depth()) return table.voltage_at(Qdt);
+			return R_load * current(Qdt, 1);
+		}
+
 
 		bool charge(double T) override {
 			return evolve(false, T);
@@ -249,31 +672,56 @@ namespace wsn::battery {
 			return evolve(true, T);
 		}
 
+		// error allowed per step of the adaptive integrator, as a fraction of the max capacity.
+		// 0 integrates in fixed steps of the sampling time
+		void set_tolerance(double tol) {
+			tolerance = tol;
+		}
+
+		double get_tolerance() const {
+			return tolerance;
+		}
+
+		// look the evolution up in the shared discharge tables where they reach, rather than integrating
+		void set_use_tables(bool u) {
+			use_tables = u;
+		}
+
+		bool get_use_tables() const {
+			return use_tables;
+		}
+
 	protected:
-		bool evolve(bool consuming, double T) {
-			if ((!consuming && Qdt <= 0.) || (consuming && Qdt >= Qmax)) return false;
+		// the load current settles within a few sampling steps to the one satisfying the voltage equation,
+		// which makes the depth of discharge a 1-d ODE: dQdt/dt = sign * current(Qdt) / 3600
+		double current(double q, int sign) const {
+			double k = Qmax / (Qmax - q);
+			return (1.164 * U_battnorm - coef.alpha * k * q + coef.beta * exp(-26.5487 * q)) / (R_load + sign * (coef.r0 + coef.gamma * k));
+		}
 
-			double last_Qdt = Qdt;
+		bool deplete() override {
+			if (Qdt >= Qmax) return false;
 
-			int consuming_sign = consuming ? 1 : -1;
-			double I_batt, U_batt,
-				I_load = U_battnorm / R_load,
-				Rin = (U_battnorm / Q_rated) / 100,
-				rate, effective_rate;
+			double last_Qdt = Qdt;
+			Qdt = Qmax;
+			fire(event_consume, Qdt - last_Qdt);
+			return true;
+		}
 
-			auto power = get_node()->get_power();
+		bool evolve(bool consuming, double T) {
+			if ((!consuming && Qdt <= 0.) || (consuming && Qdt >= Qmax)) return false;
 
-			for (double t = 0; t < T; t += dt) {
-				rate = consuming_sign * I_load / 3600;
-				effective_rate = consuming ? rate : std::min(rate, power->get_max_power());
-				Qdt += rate * dt;
+			double last_Qdt = Qdt;
 
-				if ((Qdt >= Qmax) || (Qdt <= 0.)) break;
+			// with a load below the internal resistances the current never settles, it keeps overshooting
+			bool settles = R_load > coef.r0 + coef.gamma * Qmax / (Qmax - Qdt);
 
-				I_batt = consuming_sign * I_load;
-				U_batt = 1.164*U_battnorm - Rin * I_batt - (((0.076*Qmax) / (Qmax - Qdt))*(I_batt + Qdt)) + 3.5653*(exp(-26.5487*Qdt));
-				I_load = U_batt / R_load;
+			if (tolerance > 0 && settles) {
+				if (!use_tables || !look_up(consuming ? 1 : -1, T))
+					integrate(consuming ? 1 : -1, T);
 			}
+			else
+				step(consuming, T);
 
 			if (Qdt == last_Qdt) return false;
 
@@ -300,6 +748,294 @@ namespace wsn::battery {
 				return true;
 			}
 		}
+
+		void step(bool consuming, double T) {
+			int consuming_sign = consuming ? 1 : -1;
+			double I_batt, U_batt, k,
+				I_load = U_battnorm / R_load,
+				rate, effective_rate;
+
+			auto& power = get_node_ref().get_power();
+
+			for (double t = 0; t < T; t += dt) {
+				rate = consuming_sign * I_load / 3600;
+				effective_rate = consuming ? rate : std::min(rate, power->get_max_power());
+				Qdt += rate * dt;
+
+				if ((Qdt >= Qmax) || (Qdt <= 0.)) break;
+
+				I_batt = consuming_sign * I_load;
+				k = Qmax / (Qmax - Qdt);
+				U_batt = 1.164*U_battnorm - (coef.r0 + coef.gamma * k) * I_batt - coef.alpha * k * Qdt + coef.beta*(exp(-26.5487*Qdt));
+				I_load = U_batt / R_load;
+			}
+		}
+
+		// embedded Runge-Kutta 3(2) (Bogacki-Shampine) with step size control. the step carries over
+		// between calls, so once the exponential term has died out a whole call is a single step
+		void integrate(int sign, double T) {
+			auto f = [this, sign](double q) {
+				return sign * current(q, sign) / 3600;
+			};
+
+			double allowed = tolerance * Qmax;
+			double t = 0, q = Qdt, k1 = f(q);
+
+			while (t < T) {
+				double h = std::min(std::max(step_size, dt), T - t);
+
+				double k2 = f(q + h / 2 * k1);
+				double k3 = f(q + 3 * h / 4 * k2);
+				double q1 = q + h * (2 * k1 + 3 * k2 + 4 * k3) / 9;
+				double k4 = f(q1);
+				double err = h * std::abs(-5 * k1 / 72 + k2 / 12 + k3 / 9 - k4 / 8);
+
+				double factor = err > 0 ? 0.9 * std::cbrt(allowed / err) : 5.;
+				if (!(factor >= 0.2)) factor = 0.2;
+				if (factor > 5.) factor = 5.;
+
+				// steps down to the sampling time are always taken
+				if (!(err <= allowed) && h > dt) {
+					step_size = h * factor;
+					continue;
+				}
+
+				if (h >= step_size || factor < 1.) step_size = h * factor;
+
+				t += h;
+				q = q1;
+				k1 = k4;
+
+				if ((q >= Qmax) || (q <= 0.)) break;
+			}
+
+			Qdt = q;
+		}
+
+		// false where the table doesn't reach, for the integrator to take over
+		bool look_up(int sign, double T) {
+			auto& table = get_table(sign);
+			if (table.empty() || Qdt > table.get_max_depth()) return false;
+
+			double t = table.time_at(Qdt) + sign * T;
+
+			if (t <= 0.) Qdt = 0.;
+			else if (t <= table.get_max_time()) Qdt = table.depth_at(t);
+			else {
+				// the rest up to the stall near Qmax
+				Qdt = table.get_max_depth();
+				integrate(sign, t - table.get_max_time());
+			}
+
+			return true;
+		}
+	};
+
+	// advances many batteries of one type by the same time in one pass, over their states gathered into
+	// arrays, for systems updating a whole population at the same tick (see archetype::each_battery).
+	// lanes that reach full or empty are masked out and only those crossings are reported, posted to
+	// the batteries' mailboxes: there is no event_charge/event_consume per battery
+	template <typename battery_type>
+	class batch;
+
+
+
+	template <typename battery_type>
+	class batch_base {
+	protected:
+		std::vector<battery_type*> lanes;
+		std::vector<uchar> result;
+
+		static void post_event(battery_type* b, uint event_id) {
+			b->post([h = handle<entity>(b), event_id]() {
+				if (auto p = h.get()) p->fire(event_id);
+			});
+		}
+
+	public:
+		void add(battery_type& b) {
+			lanes.push_back(&b);
+		}
+
+		void clear() {
+			lanes.clear();
+		}
+
+		size_t size() const {
+			return lanes.size();
+		}
+
+		// per battery, what charge(T)/consume(T) would have returned for the last call
+		const std::vector<uchar>& get_result() const {
+			return result;
+		}
+	};
+
+
+
+	template <>
+	class batch<linear> : public batch_base<linear> {
+	protected:
+		std::vector<double> level, bound, rate;
+
+		void advance(bool consuming, double T) {
+			auto n = lanes.size();
+			level.resize(n);
+			bound.resize(n);
+			rate.resize(n);
+			result.assign(n, 0);
+
+			// lazy batteries keep time on their own
+			for (size_t i = 0; i < n; i++) {
+				auto b = lanes[i];
+				level[i] = b->level;
+				bound[i] = consuming ? b->minl : b->maxl;
+				rate[i] = b->lazy ? 0. : consuming ? -b->consume_rate : std::min(b->charge_rate, b->get_node_ref().get_power()->get_max_power());
+			}
+
+			auto l = level.data(), r = rate.data(), m = bound.data();
+			if (consuming) {
+				for (size_t i = 0; i < n; i++) l[i] = std::max(l[i] + T * r[i], std::min(l[i], m[i]));
+			}
+			else {
+				for (size_t i = 0; i < n; i++) l[i] = std::min(l[i] + T * r[i], std::max(l[i], m[i]));
+			}
+
+			for (size_t i = 0; i < n; i++) {
+				auto b = lanes[i];
+				if (b->lazy) continue;
+
+				bool moved = level[i] != b->level;
+				bool crossed = moved && level[i] == bound[i];
+				b->level = level[i];
+
+				result[i] = consuming ? moved && !crossed : moved;
+				if (crossed) post_event(b, consuming ? basic_battery::event_empty : basic_battery::event_full);
+			}
+		}
+
+	public:
+		void charge(double T) {
+			advance(false, T);
+		}
+
+		void consume(double T) {
+			advance(true, T);
+		}
+	};
+
+
+
+	// the depth of discharge of all lanes follows chemical's ODE, stepped together with classical Runge-Kutta
+	// in branch-free loops over the lanes (std::exp included) that compilers vectorize. a single step covers
+	// the call unless a lane is still in the exponential term's transient
+	template <>
+	class batch<chemical> : public batch_base<chemical> {
+	protected:
+		std::vector<double> q, qmax, u, r, alpha, beta, gamma, r0, live, k1, k2, k3, k4, tmp;
+		double transient_step = 10.;
+
+		void derivative(const double* x, double* dx, double sign) {
+			auto n = lanes.size();
+			auto pqmax = qmax.data(), pu = u.data(), pr = r.data(), pa = alpha.data(), pb = beta.data(), pg = gamma.data(), pr0 = r0.data();
+
+			for (size_t i = 0; i < n; i++) {
+				double k = pqmax[i] / (pqmax[i] - x[i]);
+				double I = (1.164 * pu[i] - pa[i] * k * x[i] + pb[i] * std::exp(-26.5487 * x[i])) / (pr[i] + sign * (pr0[i] + pg[i] * k));
+				dx[i] = sign * I / 3600;
+			}
+		}
+
+		void axpy(const double* x, const double* dx, double h, double* y) {
+			auto n = lanes.size();
+			for (size_t i = 0; i < n; i++) y[i] = x[i] + h * dx[i];
+		}
+
+		void advance(bool consuming, double T) {
+			auto n = lanes.size();
+			for (auto v : { &q, &qmax, &u, &r, &alpha, &beta, &gamma, &r0, &live, &k1, &k2, &k3, &k4, &tmp }) v->resize(n);
+			result.assign(n, 0);
+
+			double sign = consuming ? 1. : -1.;
+			double lowest = std::numeric_limits<double>::max();
+			std::vector<uchar> scalar(n, 0);
+
+			for (size_t i = 0; i < n; i++) {
+				auto b = lanes[i];
+				q[i] = b->Qdt;
+				qmax[i] = b->Qmax;
+				u[i] = b->U_battnorm;
+				r[i] = b->R_load;
+				alpha[i] = b->coef.alpha;
+				beta[i] = b->coef.beta;
+				gamma[i] = b->coef.gamma;
+				r0[i] = b->coef.r0;
+				live[i] = consuming ? q[i] < qmax[i] : q[i] > 0.;
+
+				// same cases as chemical::evolve leaves to the fixed steps
+				if (b->tolerance <= 0 || !(r[i] > r0[i] + gamma[i] * qmax[i] / (qmax[i] - q[i]))) {
+					scalar[i] = live[i] != 0;
+					live[i] = 0;
+				}
+
+				if (live[i]) lowest = std::min(lowest, q[i]);
+			}
+
+			uint steps = 26.5487 * lowest < 30. ? (uint)std::ceil(T / transient_step) : 1;
+			double h = T / steps;
+			auto pq = q.data(), pqmax = qmax.data(), plive = live.data(), pk1 = k1.data(), pk2 = k2.data(), pk3 = k3.data(), pk4 = k4.data(), ptmp = tmp.data();
+
+			for (uint s = 0; s < steps; s++) {
+				derivative(pq, pk1, sign);
+				axpy(pq, pk1, h / 2, ptmp);
+				derivative(ptmp, pk2, sign);
+				axpy(pq, pk2, h / 2, ptmp);
+				derivative(ptmp, pk3, sign);
+				axpy(pq, pk3, h, ptmp);
+				derivative(ptmp, pk4, sign);
+
+				for (size_t i = 0; i < n; i++) {
+					double x = pq[i] + h * (pk1[i] + 2 * pk2[i] + 2 * pk3[i] + pk4[i]) / 6;
+					x = std::min(std::max(x, 0.), pqmax[i]);
+					pq[i] = plive[i] != 0 ? x : pq[i];	// masked lanes may hold anything, inf at empty
+					plive[i] = (pq[i] > 0.) & (pq[i] < pqmax[i]) & (plive[i] != 0);
+				}
+			}
+
+			for (size_t i = 0; i < n; i++) {
+				auto b = lanes[i];
+
+				if (scalar[i]) {
+					result[i] = consuming ? b->consume(T) : b->charge(T);
+					continue;
+				}
+
+				bool moved = q[i] != b->Qdt;
+				bool crossed = moved && (consuming ? q[i] >= qmax[i] : q[i] <= 0.);
+				b->Qdt = q[i];
+
+				result[i] = consuming ? moved && !crossed : moved;
+				if (crossed) post_event(b, consuming ? basic_battery::event_empty : basic_battery::event_full);
+			}
+		}
+
+	public:
+		void charge(double T) {
+			advance(false, T);
+		}
+
+		void consume(double T) {
+			advance(true, T);
+		}
+
+		// step while a lane's exponential term is still significant, a single step afterwards
+		void set_transient_step(double st) {
+			transient_step = st;
+		}
+
+		double get_transient_step() const {
+			return transient_step;
+		}
 	};
 
 }
\ No newline at end of file
@@ -3,39 +3,98 @@
 #include "wsnsim.h"
 #include <limits>
 #include <variant>
+#include <map>
+#include <queue>
+#include <shared_mutex>
 
 
 namespace wsn::comm {
 
 
 
+	// destination of a frame a layer above multicasts to its neighbours: each of them takes it
+	constexpr uint any_neighbor = std::numeric_limits<uint>::max();
+
+
+
 	class none : public basic_comm {
-	public:
-		void send(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
-			fire(event_drop, make_shared_data(data), to);
+	protected:
+		void send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) override {
+			fire(event_drop, std::make_shared<std::vector<uchar>>(std::move(frame)), to);
 			// do nothing
 		}
+
+		void multicast_frame(std::vector<uchar> frame, const node_list& receivers) override {
+			auto rframe = std::make_shared<std::vector<uchar>>(std::move(frame));
+			for (auto& to : receivers) {
+				fire(event_drop, rframe, to);
+			}
+		}
 	};
 
 
-	template <typename wrapped_comm_type>
-	class with_delay_generic : public wrapped_comm_type {
+	// derived_type provides calc_delay(to), which is bound statically
+	template <typename derived_type, typename wrapped_comm_type>
+	class with_delay_crtp : public wrapped_comm_type {
+	protected:
+		std::chrono::duration<double> delay_resolution{ 1e-3 };	// receivers whose delays fall in the same bucket are delivered together
+
+		std::chrono::duration<double> delay_to(std::shared_ptr<basic_node> to) {
+			return static_cast<derived_type*>(this)->calc_delay(to);
+		}
+
 	public:
-		virtual std::chrono::duration<double> calc_delay(std::shared_ptr<basic_node> to) = 0;
+		template <typename _Rep, typename _Period>
+		void set_delay_resolution(std::chrono::duration<_Rep, _Period> res) {
+			delay_resolution = std::chrono::duration_cast<std::chrono::duration<double>>(res);
+		}
 
-		void send(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
-			this->fire(basic_comm::event_send, this->make_shared_data(data), to);
+		std::chrono::duration<double> get_delay_resolution() const {
+			return delay_resolution;
+		}
+
+	protected:
+		void send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) override {
+			auto rframe = std::make_shared<std::vector<uchar>>(std::move(frame));
+			this->fire(basic_comm::event_send, rframe, to);
 
-			auto delay = calc_delay(to);
-			this->timer_once(delay, true, [newdata = this->make_shared_data(data), to, this](event&) {
-				to->get_comm()->receive(newdata, this->get_node());
+			auto delay = delay_to(to);
+			this->timer_once(delay, true, [rframe, to, this](event&) {
+				this->deliver(rframe, { to });
 			});
 		}
+
+		void multicast_frame(std::vector<uchar> frame, const basic_comm::node_list& receivers) override {
+			auto rframe = std::make_shared<std::vector<uchar>>(std::move(frame));
+
+			std::map<long long, basic_comm::node_list> buckets;
+			for (auto& to : receivers) {
+				this->fire(basic_comm::event_send, rframe, to);
+
+				auto bucket = (long long)std::ceil(delay_to(to) / delay_resolution);
+				buckets[bucket].push_back(to);
+			}
+
+			// one timer per bucket, not per receiver
+			for (auto& b : buckets) {
+				this->timer_once(b.first * delay_resolution, true, [rframe, bucket_receivers = std::move(b.second), this](event&) {
+					this->deliver(rframe, bucket_receivers);
+				});
+			}
+		}
+	};
+
+
+	// for delay layers defined out of this file: calc_delay stays a virtual to override
+	template <typename wrapped_comm_type>
+	class with_delay_generic : public with_delay_crtp<with_delay_generic<wrapped_comm_type>, wrapped_comm_type> {
+	public:
+		virtual std::chrono::duration<double> calc_delay(std::shared_ptr<basic_node> to) = 0;
 	};
 
 
 	template <typename wrapped_comm_type>
-	class with_delay_linear : public with_delay_generic<wrapped_comm_type> {
+	class with_delay_linear : public with_delay_crtp<with_delay_linear<wrapped_comm_type>, wrapped_comm_type> {
 	protected:
 		std::default_random_engine random_generator{ (uint)time(nullptr) };
 		std::uniform_real_distribution<double> random{ 0., 0. };
@@ -60,11 +119,11 @@ namespace wsn::comm {
 				std::chrono::duration_cast<std::chrono::duration<double>>(_random_max).count());
 		}
 
-		std::chrono::duration<double> calc_delay(std::shared_ptr<basic_node> to) override {
-			auto tto = std::dynamic_pointer_cast<with_delay_linear<wrapped_comm_type>>(to->get_comm());
+		std::chrono::duration<double> calc_delay(std::shared_ptr<basic_node> to) {
+			auto tto = dynamic_cast<const with_delay_linear*>(to->get_comm().get());
 			assert(tto);
 
-			double distance = this->get_node()->get_location().distance_to(to->get_location());
+			double distance = this->get_node_ref().get_location().distance_to(to->get_location());
 
 			return sender_base + tto->receiver_base + (multiplier * distance) +
 				std::chrono::duration<double>(random(random_generator));
@@ -82,6 +141,11 @@ namespace wsn::comm {
 			ushort pkg_id;
 		};
 
+	public:
+		static constexpr uint header_offset = wrapped_comm_type::frame_header_size;
+		static constexpr uint frame_header_size = header_offset + sizeof(header);
+
+	protected:
 		struct package_info {
 			double arrival_time;
 			ushort pkg_count;
@@ -89,33 +153,29 @@ namespace wsn::comm {
 			std::vector<uchar> data;
 		};
 
-		uint msg_id = 1;
+		std::atomic<uint> msg_id = 1;	// send may be called from outside the node's mailbox
 		uint package_size = 64;
 		double time_to_keep = 60;	// seconds
 		std::multimap<uint, std::shared_ptr<package_info>> buffer;
-		std::mutex buffer_mutex;
 
 		void split_data(const std::vector<uchar>& data, std::list<std::vector<uchar>>& packages) {
 			uint max_pkg_data_sz = package_size - sizeof(header);
 
 			header hdr;
 			hdr.msg_id = msg_id++;
-			hdr.pkg_count = ushort((data.size() + package_size - 1) / package_size);
+			hdr.pkg_count = ushort((data.size() + max_pkg_data_sz - 1) / max_pkg_data_sz);
 
 			for (uint i = 1; i <= hdr.pkg_count; i++) {
 				uint pkg_data_sz = (i < hdr.pkg_count) ? max_pkg_data_sz : (data.size() - (i - 1) * max_pkg_data_sz);
-				std::vector<uchar> pkg(pkg_data_sz + sizeof(header));
+				auto pkg = this->make_frame(frame_header_size, data.data() + (i - 1) * max_pkg_data_sz, pkg_data_sz);
 
 				hdr.pkg_id = i;
-				std::memcpy(pkg.data(), &hdr, sizeof(hdr));
-				std::memcpy(pkg.data() + sizeof(hdr), data.data() + (i - 1) * max_pkg_data_sz, pkg_data_sz);
-				packages.emplace_back(pkg);
+				this->write_header(pkg, header_offset, hdr);
+				packages.emplace_back(std::move(pkg));
 			}
 		}
 
 		bool reconstruct_data(uint msg_id, std::vector<uchar>& data) {
-			std::lock_guard lock(buffer_mutex);
-
 			auto range = buffer.equal_range(msg_id);
 			std::list<std::shared_ptr<package_info>> packages;
 			for (auto itr = range.first; itr != range.second; itr++)
@@ -160,16 +220,16 @@ namespace wsn::comm {
 		void send(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
 			std::list<std::vector<uchar>> packages;
 			split_data(data, packages);
-			std::for_each(std::execution::par, packages.begin(), packages.end(), [this, to](auto& pkg) {
-				wrapped_comm_type::send(pkg, to);
+			std::for_each(packages.begin(), packages.end(), [this, to](auto& pkg) {
+				wrapped_comm_type::send_frame(std::move(pkg), to);
 			});
 		}
 
 		void route(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
 			std::list<std::vector<uchar>> packages;
 			split_data(data, packages);
-			std::for_each(std::execution::par, packages.begin(), packages.end(), [this, to](auto& pkg) {
-				wrapped_comm_type::route(pkg, to);
+			std::for_each(packages.begin(), packages.end(), [this, to](auto& pkg) {
+				wrapped_comm_type::route_frame(std::move(pkg), to);
 			});
 		}
 
@@ -177,40 +237,33 @@ namespace wsn::comm {
 			if (!wrapped_comm_type::receive(data, from)) return false;
 
 			header hdr;
-			this->extract_header(*data, hdr);
-			this->remove_header(*data, sizeof(hdr));
+			this->read_header(*data, header_offset, hdr);
 
-			{
-				std::lock_guard lock(buffer_mutex);
-				// make sure no duplicate when something goes wrong!
-				auto range = buffer.equal_range(hdr.msg_id);
-				for (auto itr = range.first; itr != range.second; itr++) {
-					if (itr->second->pkg_id == hdr.pkg_id) return false;
-				}
+			// make sure no duplicate when something goes wrong!
+			auto range = buffer.equal_range(hdr.msg_id);
+			for (auto itr = range.first; itr != range.second; itr++) {
+				if (itr->second->pkg_id == hdr.pkg_id) return false;
+			}
 
-				// push package to buffer
-				auto inf = std::make_shared<package_info>();
-				inf->arrival_time = this->get_local_clock_time();
-				inf->pkg_count = hdr.pkg_count;
-				inf->pkg_id = hdr.pkg_id;
-				inf->data = *data;
+			// push package to buffer
+			auto inf = std::make_shared<package_info>();
+			inf->arrival_time = this->get_world_clock_time();
+			inf->pkg_count = hdr.pkg_count;
+			inf->pkg_id = hdr.pkg_id;
+			inf->data.assign(data->begin() + frame_header_size, data->end());
 
-				buffer.emplace(hdr.msg_id, inf);
-			}
+			buffer.emplace(hdr.msg_id, inf);
 
 			auto orgdata = std::make_shared<std::vector<uchar>>();
 			bool ok = reconstruct_data(hdr.msg_id, *orgdata);
 			if (ok) data = orgdata;
 
 			// remove expired packages!
-			double good_arrival_time = this->get_local_clock_time() - time_to_keep;
-			{
-				std::lock_guard lock(buffer_mutex);
-				for (auto itr = buffer.begin(); itr != buffer.end(); ) {
-					if (itr->second->arrival_time < good_arrival_time)
-						itr = buffer.erase(itr);
-					else itr++;
-				}
+			double good_arrival_time = this->get_world_clock_time() - time_to_keep;
+			for (auto itr = buffer.begin(); itr != buffer.end(); ) {
+				if (itr->second->arrival_time < good_arrival_time)
+					itr = buffer.erase(itr);
+				else itr++;
 			}
 
 			return ok;
@@ -246,32 +299,31 @@ namespace wsn::comm {
 
 
 
-	template <typename msg_id_type, typename wrapped_comm_type>
-	class loop_avoidance : public wrapped_comm_type {
+	// derived_type provides get_message_id(data), which is bound statically
+	template <typename derived_type, typename msg_id_type, typename wrapped_comm_type>
+	class loop_avoidance_crtp : public wrapped_comm_type {
 	protected:
 		struct msg_info {
 			double arrival_time;
 			msg_id_type msg_id;
 		};
 
-		std::mutex last_messages_mutex;
 		std::vector<msg_info> last_messages;
-		uint last_messages_max = 100;	// max length, disabled by default
+		uint last_messages_max = 100;	// max length
 		double last_messages_time = 30;	// seconds, disabled by default
 
 		void add_last_message_info(const msg_id_type& msg_id) {
 			msg_info inf;
-			inf.arrival_time = this->get_local_clock_time();
+			inf.arrival_time = this->get_world_clock_time();
 			inf.msg_id = msg_id;
 			last_messages.push_back(inf);
 
-			if (last_messages_max >= 0) {
-				while (last_messages.size() > last_messages_max)
-					last_messages.erase(last_messages.end() - 1);
-			}
+			// the oldest ones make room
+			if (last_messages.size() > last_messages_max)
+				last_messages.erase(last_messages.begin(), last_messages.end() - last_messages_max);
 
 			if (last_messages_time >= 0) {
-				double last_good_time = this->get_local_clock_time() - last_messages_time;
+				double last_good_time = this->get_world_clock_time() - last_messages_time;
 				auto itr = std::remove_if(last_messages.begin(), last_messages.end(), [last_good_time](auto& e) {
 					return e.arrival_time < last_good_time;
 				});
@@ -296,14 +348,11 @@ namespace wsn::comm {
 			last_messages_time = v;
 		}
 
-		virtual msg_id_type get_message_id(const std::vector<uchar>& data) const = 0;
-
 		bool receive(std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) override {
 			if (!wrapped_comm_type::receive(data, from)) return false;
 
-			auto msg_id = get_message_id(*data);
+			auto msg_id = static_cast<const derived_type*>(this)->get_message_id(*data);
 
-			std::lock_guard lock(last_messages_mutex);
 			if (std::find_if(last_messages.begin(), last_messages.end(), [msg_id](auto& e) {
 				return msg_id == e.msg_id;
 			}) != last_messages.end()) return false;
@@ -315,6 +364,15 @@ namespace wsn::comm {
 
 
 
+	// for routing layers defined out of this file: get_message_id stays a virtual to override
+	template <typename msg_id_type, typename wrapped_comm_type>
+	class loop_avoidance : public loop_avoidance_crtp<loop_avoidance<msg_id_type, wrapped_comm_type>, msg_id_type, wrapped_comm_type> {
+	public:
+		virtual msg_id_type get_message_id(const std::vector<uchar>& data) const = 0;
+	};
+
+
+
 	template <typename wrapped_comm_type>
 	class hierarchical_routing : public wrapped_comm_type {
 	protected:
@@ -325,6 +383,9 @@ namespace wsn::comm {
 		std::list<std::shared_ptr<basic_node>> neighbors;
 
 	public:
+		static constexpr uint header_offset = wrapped_comm_type::frame_header_size;
+		static constexpr uint frame_header_size = header_offset + sizeof(header);
+
 		const std::list<std::shared_ptr<basic_node>>& get_neighbors() const {
 			return neighbors;
 		}
@@ -358,13 +419,13 @@ namespace wsn::comm {
 			if (!wrapped_comm_type::receive(data, from)) return false;
 
 			header hdr;
-			this->extract_header(*data, hdr);
+			this->read_header(*data, header_offset, hdr);
 
-			if (hdr.dest_id == this->get_node()->get_id()) return true;
+			if (hdr.dest_id == this->get_node_ref().get_id() || hdr.dest_id == any_neighbor) return true;
 
 			if (neighbors.size() > 0) {
-				std::for_each(std::execution::par, neighbors.begin(), neighbors.end(), [this, data](auto p) {
-					wrapped_comm_type::send(*data, p);
+				std::for_each(neighbors.begin(), neighbors.end(), [this, data](auto p) {
+					wrapped_comm_type::send_frame(*data, p);
 				});
 
 				this->fire(basic_comm::event_forward, data, from);
@@ -377,15 +438,36 @@ namespace wsn::comm {
 		}
 
 		void route(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
-			if (to->is_same(this->get_node())) return;
+			route_frame(this->make_frame(frame_header_size, data), to);
+		}
+
+	protected:
+		// a frame a layer above sends straight to a neighbour, or multicasts to several, carries this header too, addressed to them
+		void send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) override {
+			header hdr;
+			hdr.dest_id = to->get_id();
+
+			this->write_header(frame, header_offset, hdr);
+			wrapped_comm_type::send_frame(std::move(frame), to);
+		}
+
+		void multicast_frame(std::vector<uchar> frame, const basic_comm::node_list& receivers) override {
+			header hdr;
+			hdr.dest_id = any_neighbor;
+
+			this->write_header(frame, header_offset, hdr);
+			wrapped_comm_type::multicast_frame(std::move(frame), receivers);
+		}
+
+		void route_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) {
+			if (to->is_same(this->get_node_ref())) return;
 
 			header hdr;
 			hdr.dest_id = to->get_id();
 
-			auto newdata = data;
-			this->add_header(newdata, hdr);
-			std::for_each(std::execution::par, neighbors.begin(), neighbors.end(), [this, &newdata](auto p) {
-				wrapped_comm_type::send(newdata, p);
+			this->write_header(frame, header_offset, hdr);
+			std::for_each(neighbors.begin(), neighbors.end(), [this, &frame](auto p) {
+				wrapped_comm_type::send_frame(frame, p);
 			});
 		}
 	};
@@ -394,9 +476,9 @@ namespace wsn::comm {
 	
 	// similar to hierarchical_routing but with loop_avoidance
 	template <typename wrapped_comm_type>
-	class fixed_routing : public hierarchical_routing<loop_avoidance<std::pair<uint, uint>, wrapped_comm_type>> {
+	class fixed_routing : public hierarchical_routing<loop_avoidance_crtp<fixed_routing<wrapped_comm_type>, std::pair<uint, uint>, wrapped_comm_type>> {
 	protected:
-		using base_class = loop_avoidance<std::pair<uint, uint>, wrapped_comm_type>;
+		using base_class = loop_avoidance_crtp<fixed_routing<wrapped_comm_type>, std::pair<uint, uint>, wrapped_comm_type>;
 
 		struct header {
 			uint dest_id;
@@ -407,9 +489,13 @@ namespace wsn::comm {
 		uint message_id = 1;
 
 	public:
-		std::pair<uint, uint> get_message_id(const std::vector<uchar>& data) const override {
+		// the header of hierarchical_routing is never written, this one takes its place
+		static constexpr uint header_offset = base_class::frame_header_size;
+		static constexpr uint frame_header_size = header_offset + sizeof(header);
+
+		std::pair<uint, uint> get_message_id(const std::vector<uchar>& data) const {
 			header hdr;
-			this->extract_header(data, hdr);
+			this->read_header(data, header_offset, hdr);
 			return std::make_pair(hdr.source_id, hdr.msg_id);
 		}
 
@@ -417,13 +503,13 @@ namespace wsn::comm {
 			if (!base_class::receive(data, from)) return false;
 
 			header hdr;
-			this->extract_header(*data, hdr);
+			this->read_header(*data, header_offset, hdr);
 
-			if (hdr.dest_id == this->get_node()->get_id()) return true;
+			if (hdr.dest_id == this->get_node_ref().get_id() || hdr.dest_id == any_neighbor) return true;
 
 			if (this->neighbors.size() > 0) {
-				std::for_each(std::execution::par, this->neighbors.begin(), this->neighbors.end(), [this, data](auto p) {
-					base_class::send(*data, p);
+				std::for_each(this->neighbors.begin(), this->neighbors.end(), [this, data](auto p) {
+					base_class::send_frame(*data, p);
 				});
 
 				this->fire(basic_comm::event_forward, data, from);
@@ -432,17 +518,42 @@ namespace wsn::comm {
 		}
 
 		void route(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
-			if (to->is_same(this->get_node())) return;
+			route_frame(this->make_frame(frame_header_size, data), to);
+		}
 
+	protected:
+		// a frame a layer above sends straight to a neighbour, or multicasts to several, carries this header too, addressed to them
+		void send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) override {
 			header hdr;
 			hdr.dest_id = to->get_id();
 			hdr.source_id = this->get_id();
 			hdr.msg_id = message_id++;
 
-			auto newdata = data;
-			this->add_header(newdata, hdr);
-			std::for_each(std::execution::par, this->neighbors.begin(), this->neighbors.end(), [this, &newdata](auto p) {
-				base_class::send(newdata, p);
+			this->write_header(frame, header_offset, hdr);
+			base_class::send_frame(std::move(frame), to);
+		}
+
+		void multicast_frame(std::vector<uchar> frame, const basic_comm::node_list& receivers) override {
+			header hdr;
+			hdr.dest_id = any_neighbor;
+			hdr.source_id = this->get_id();
+			hdr.msg_id = message_id++;
+
+			this->write_header(frame, header_offset, hdr);
+			base_class::multicast_frame(std::move(frame), receivers);
+		}
+
+		void route_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) {
+			if (to->is_same(this->get_node_ref())) return;
+
+			header hdr;
+			hdr.dest_id = to->get_id();
+			hdr.source_id = this->get_id();
+			hdr.msg_id = message_id++;
+
+			this->write_header(frame, header_offset, hdr);
+			std::for_each(this->neighbors.begin(), this->neighbors.end(), [this, &frame](auto p) {
+				base_class::send_frame(frame, p);
 			});
 		}
 	};
@@ -451,9 +562,9 @@ namespace wsn::comm {
 
 
 	template <typename wrapped_comm_type>
-	class broadcast_routing : public loop_avoidance<std::pair<uint, uint>, wrapped_comm_type> {
+	class broadcast_routing : public loop_avoidance_crtp<broadcast_routing<wrapped_comm_type>, std::pair<uint, uint>, wrapped_comm_type> {
 	protected:
-		using base_class = loop_avoidance<std::pair<uint, uint>, wrapped_comm_type>;
+		using base_class = loop_avoidance_crtp<broadcast_routing<wrapped_comm_type>, std::pair<uint, uint>, wrapped_comm_type>;
 
 		struct header {
 			uint dest_id;
@@ -470,6 +581,9 @@ namespace wsn::comm {
 		int time_to_live = -1;
 
 	public:
+		static constexpr uint header_offset = base_class::frame_header_size;
+		static constexpr uint frame_header_size = header_offset + sizeof(header);
+
 		double get_broadcast_range() const {
 			return broadcast_range;
 		}
@@ -494,44 +608,41 @@ namespace wsn::comm {
 			hops_to_live = htl;
 		}
 
-		std::pair<uint, uint> get_message_id(const std::vector<uchar>& data) const override {
+		std::pair<uint, uint> get_message_id(const std::vector<uchar>& data) const {
 			header hdr;
-			this->extract_header(data, hdr);
+			this->read_header(data, header_offset, hdr);
 			return std::make_pair(hdr.source_id, hdr.msg_id);
 		}
 
 		bool receive(std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) override {
 			if (!base_class::receive(data, from)) return false;
 
-			auto& hdr = this->extract_header<header>(*data);
+			header hdr;
+			this->read_header(*data, header_offset, hdr);
 
 			// the message is to me!
-			if (hdr.dest_id == this->get_node()->get_id()) {
-				this->remove_header(*data, sizeof(hdr));
-				return true;
-			}
+			if (hdr.dest_id == this->get_node_ref().get_id() || hdr.dest_id == any_neighbor) return true;
 
 			// forward if not expired
-			auto newdata = *data;
-			auto& newhdr = this->extract_header<header>(newdata);
-
-			if (newhdr.time_to_live > 0 && this->get_world_clock_time() - newhdr.time_to_live >= newhdr.transmission_time) {
+			if (hdr.time_to_live > 0 && this->get_world_clock_time() - hdr.time_to_live >= hdr.transmission_time) {
 				this->fire(basic_comm::event_drop, data, from);
 				return false;
 			}
 
-			if (newhdr.hops_to_live == 0 || newhdr.hops_to_live == 1) {
+			if (hdr.hops_to_live == 0 || hdr.hops_to_live == 1) {
 				this->fire(basic_comm::event_drop, data, from);
 				return false;
 			}
-			else if (newhdr.hops_to_live > 1) {
-				newhdr.hops_to_live--;
+			else if (hdr.hops_to_live > 1) {
+				hdr.hops_to_live--;
 			}
 
+			// the received frame is shared with the other receivers, so the forwarded one is a copy
+			auto newdata = *data;
+			this->write_header(newdata, header_offset, hdr);
+
 			this->fire(basic_comm::event_forward, this->make_shared_data(newdata), from);
-			this->broadcast_by_distance(newdata, broadcast_range, [this, &newdata](auto p) {
-				base_class::send(newdata, p);
-			});
+			base_class::multicast_frame(std::move(newdata), this->find_receivers_in_range(broadcast_range));
 			return false;
 		}
 
@@ -540,7 +651,39 @@ namespace wsn::comm {
 		}
 
 		void route(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
-			if (to->is_same(this->get_node())) return;
+			route_frame(this->make_frame(frame_header_size, data), to);
+		}
+
+	protected:
+		// a frame a layer above sends straight to a neighbour, or multicasts to several, carries this header too, addressed to them
+		void send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) override {
+			header hdr;
+			hdr.dest_id = to->get_id();
+			hdr.source_id = this->get_id();
+			hdr.msg_id = message_id++;
+			hdr.transmission_time = this->get_world_clock_time();
+			hdr.time_to_live = -1;
+			hdr.hops_to_live = 1;
+
+			this->write_header(frame, header_offset, hdr);
+			base_class::send_frame(std::move(frame), to);
+		}
+
+		void multicast_frame(std::vector<uchar> frame, const basic_comm::node_list& receivers) override {
+			header hdr;
+			hdr.dest_id = any_neighbor;
+			hdr.source_id = this->get_id();
+			hdr.msg_id = message_id++;
+			hdr.transmission_time = this->get_world_clock_time();
+			hdr.time_to_live = -1;
+			hdr.hops_to_live = 1;
+
+			this->write_header(frame, header_offset, hdr);
+			base_class::multicast_frame(std::move(frame), receivers);
+		}
+
+		void route_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) {
+			if (to->is_same(this->get_node_ref())) return;
 
 			header hdr;
 			hdr.dest_id = to->get_id();
@@ -550,113 +693,845 @@ namespace wsn::comm {
 			hdr.time_to_live = time_to_live;
 			hdr.hops_to_live = hops_to_live;
 
-			auto newdata = data;
-			this->add_header(newdata, hdr);
-			this->broadcast_by_distance(newdata, broadcast_range, [this, &newdata](auto p) {
-				base_class::send(newdata, p);
+			this->write_header(frame, header_offset, hdr);
+			base_class::multicast_frame(std::move(frame), this->find_receivers_in_range(broadcast_range));
+		}
+	};
+
+
+
+
+	// shortest-path trees over the connectivity graph of a network, shared by the table_routing layers of its nodes.
+	// a tree is computed the first time a destination is routed to and repaired in place when nodes stop, restart or move.
+	class routing_table {
+	public:
+		static constexpr uint npos = std::numeric_limits<uint>::max();
+
+		// cost of the link from the first node to the second one, negative if there is no link
+		using cost_function = std::function<double(const basic_node&, const basic_node&)>;
+
+	protected:
+		struct link {
+			uint node;
+			double cost;
+		};
+
+		struct tree {
+			std::vector<uint> next_hop;		// per node index, npos if unreachable
+			std::vector<double> cost;		// per node index, cost to the destination
+		};
+
+		handle<basic_network> network;
+		cost_function link_cost;
+
+		std::vector<handle<basic_node>> nodes;
+		std::vector<bool> alive;
+		std::map<uint, uint> node_index;			// node id -> index
+		std::vector<std::vector<link>> out_links, in_links;
+		std::map<uint, tree> trees;					// destination index -> tree
+		mutable std::shared_mutex mutex;
+
+		static constexpr double infinity = std::numeric_limits<double>::infinity();
+
+		uint index_of(uint node_id) const {
+			auto itr = node_index.find(node_id);
+			return (itr == node_index.end()) ? npos : itr->second;
+		}
+
+		void build() {
+			auto net = network.lock();
+			assert(net);
+
+			auto list = net->get_nodes();
+			nodes.assign(list.begin(), list.end());
+			alive.clear();
+			out_links.assign(nodes.size(), {});
+			in_links.assign(nodes.size(), {});
+			trees.clear();
+
+			// stopped nodes stay out of the graph, as node_down would have left them
+			node_index.clear();
+			uint i = 0;
+			for (auto& n : list) {
+				node_index[n->get_id()] = i++;
+				alive.push_back(n->is_started());
+			}
+
+			for (uint u = 0; u < nodes.size(); u++) {
+				for (uint v = 0; v < nodes.size(); v++) {
+					if (u != v) add_link(u, v);
+				}
+			}
+		}
+
+		void add_link(uint u, uint v) {
+			auto nu = nodes[u].lock(), nv = nodes[v].lock();
+			if (!nu || !nv) return;
+
+			double c = link_cost(*nu, *nv);
+			if (c >= 0.) {
+				out_links[u].push_back({ v, c });
+				in_links[v].push_back({ u, c });
+			}
+		}
+
+		void relink(uint x) {
+			unlink(x);
+
+			for (uint v = 0; v < nodes.size(); v++) {
+				if (v == x) continue;
+				add_link(x, v);
+				add_link(v, x);
+			}
+		}
+
+		void unlink(uint u) {
+			auto erase_node = [](std::vector<link>& links, uint n) {
+				links.erase(std::remove_if(links.begin(), links.end(), [n](auto& l) {
+					return l.node == n;
+				}), links.end());
+			};
+
+			for (auto& l : out_links[u]) erase_node(in_links[l.node], u);
+			for (auto& l : in_links[u]) erase_node(out_links[l.node], u);
+			out_links[u].clear();
+			in_links[u].clear();
+		}
+
+		// Dijkstra from the destination over reversed links, starting from whatever is already in the queue
+		void relax(tree& t, std::priority_queue<std::pair<double, uint>, std::vector<std::pair<double, uint>>, std::greater<>>& queue) {
+			while (!queue.empty()) {
+				auto [c, v] = queue.top();
+				queue.pop();
+				if (c > t.cost[v]) continue;
+
+				for (auto& l : in_links[v]) {
+					if (!alive[l.node]) continue;
+
+					double cu = c + l.cost;
+					if (cu < t.cost[l.node]) {
+						t.cost[l.node] = cu;
+						t.next_hop[l.node] = v;
+						queue.push({ cu, l.node });
+					}
+				}
+			}
+		}
+
+		tree& compute_tree(uint dest) {
+			auto& t = trees[dest];
+			t.next_hop.assign(nodes.size(), npos);
+			t.cost.assign(nodes.size(), infinity);
+
+			if (alive[dest]) {
+				std::priority_queue<std::pair<double, uint>, std::vector<std::pair<double, uint>>, std::greater<>> queue;
+				t.cost[dest] = 0.;
+				queue.push({ 0., dest });
+				relax(t, queue);
+			}
+
+			return t;
+		}
+
+		// invalidates x and every node routing through it, then re-seeds them from their intact neighbors
+		void repair_tree(tree& t, uint x) {
+			std::vector<uint> affected{ x };
+			std::vector<bool> is_affected(nodes.size(), false);
+			is_affected[x] = true;
+
+			// links of x may just have been rebuilt, so its own children are found by their next hop
+			for (uint u = 0; u < nodes.size(); u++) {
+				if (!is_affected[u] && t.next_hop[u] == x) {
+					is_affected[u] = true;
+					affected.push_back(u);
+				}
+			}
+
+			for (uint i = 1; i < affected.size(); i++) {
+				for (auto& l : in_links[affected[i]]) {
+					if (!is_affected[l.node] && t.next_hop[l.node] == affected[i]) {
+						is_affected[l.node] = true;
+						affected.push_back(l.node);
+					}
+				}
+			}
+
+			for (auto u : affected) {
+				t.cost[u] = infinity;
+				t.next_hop[u] = npos;
+			}
+
+			std::priority_queue<std::pair<double, uint>, std::vector<std::pair<double, uint>>, std::greater<>> queue;
+			for (auto u : affected) {
+				if (!alive[u]) continue;
+
+				for (auto& l : out_links[u]) {
+					if (is_affected[l.node] || t.cost[l.node] == infinity) continue;
+
+					double cu = t.cost[l.node] + l.cost;
+					if (cu < t.cost[u]) {
+						t.cost[u] = cu;
+						t.next_hop[u] = l.node;
+					}
+				}
+
+				if (t.cost[u] < infinity) queue.push({ t.cost[u], u });
+			}
+
+			relax(t, queue);
+		}
+
+		void update_node(uint x, bool relink) {
+			if (relink) this->relink(x);
+
+			for (auto itr = trees.begin(); itr != trees.end(); ) {
+				if (itr->first == x) {
+					// the destination itself changed: nothing to salvage
+					if (alive[x]) {
+						compute_tree(x);
+						itr++;
+					}
+					else itr = trees.erase(itr);
+				}
+				else {
+					repair_tree(itr->second, x);
+					itr++;
+				}
+			}
+		}
+
+	public:
+		// nodes within range of each other are linked, the cost being their distance
+		routing_table(std::shared_ptr<basic_network> _network, double range)
+			: routing_table(_network, [range](const basic_node& a, const basic_node& b) {
+				double d = a.get_location().distance_to(b.get_location());
+				return (d <= range) ? d : -1.;
+			})
+		{
+		}
+
+		routing_table(std::shared_ptr<basic_network> _network, cost_function _link_cost)
+			: network(_network), link_cost(_link_cost)
+		{
+		}
+
+		// rebuilds the connectivity graph, e.g. after nodes have been added to the network
+		void rebuild() {
+			std::unique_lock lock(mutex);
+			build();
+		}
+
+	protected:
+		// calls f(tree, from) with the tree towards to_id and the index of from_id, computing the tree if needed.
+		// f runs under the same lock the tree was found with, so a concurrent repair can't slip in between reads.
+		// the tree is null if either node is unknown to the network.
+		template <typename function>
+		auto query(uint from_id, uint to_id, function f) {
+			{
+				std::shared_lock lock(mutex);
+
+				uint from = index_of(from_id), to = index_of(to_id);
+				if (from != npos && to != npos) {
+					auto itr = trees.find(to);
+					if (itr != trees.end()) return f(&itr->second, from);
+				}
+			}
+
+			std::unique_lock lock(mutex);
+
+			uint from = index_of(from_id), to = index_of(to_id);
+			if (from == npos || to == npos) {
+				build();
+				from = index_of(from_id);
+				to = index_of(to_id);
+				if (from == npos || to == npos) return f(nullptr, npos);
+			}
+
+			auto itr = trees.find(to);
+			auto& t = (itr == trees.end()) ? compute_tree(to) : itr->second;
+			return f(&t, from);
+		}
+
+	public:
+		std::shared_ptr<basic_node> next_hop(uint from_id, uint to_id) {
+			return query(from_id, to_id, [this](const tree* t, uint from) -> std::shared_ptr<basic_node> {
+				if (!t || t->next_hop[from] == npos) return nullptr;
+				return nodes[t->next_hop[from]].lock();
+			});
+		}
+
+		double cost(uint from_id, uint to_id) {
+			return query(from_id, to_id, [from_id, to_id](const tree* t, uint from) {
+				if (!t || t->next_hop[from] == npos) return (from_id == to_id) ? 0. : infinity;
+				return t->cost[from];
+			});
+		}
+
+		void node_down(uint node_id) {
+			std::unique_lock lock(mutex);
+			if (nodes.empty()) build();
+
+			uint x = index_of(node_id);
+			if (x == npos || !alive[x]) return;
+
+			alive[x] = false;
+			update_node(x, false);
+		}
+
+		void node_up(uint node_id) {
+			std::unique_lock lock(mutex);
+			if (nodes.empty()) build();
+
+			uint x = index_of(node_id);
+			if (x == npos || alive[x]) return;
+
+			alive[x] = true;
+			update_node(x, false);
+		}
+
+		void node_moved(uint node_id) {
+			std::unique_lock lock(mutex);
+			if (nodes.empty()) build();
+
+			uint x = index_of(node_id);
+			if (x == npos) return;
+
+			update_node(x, true);
+		}
+	};
+
+
+
+	// unicast along precomputed shortest paths: each hop sends to exactly one next hop taken from a shared routing_table
+	template <typename wrapped_comm_type>
+	class table_routing : public wrapped_comm_type {
+	protected:
+		struct header {
+			uint dest_id;
+			uint source_id;
+			uint msg_id;
+			int hops_to_live;
+		};
+
+		std::shared_ptr<routing_table> table;
+		uint message_id = 1;
+		int hops_to_live = 64;	// next hops disagree while the table is being repaired, frames caught in a loop die out
+
+	public:
+		static constexpr uint header_offset = wrapped_comm_type::frame_header_size;
+		static constexpr uint frame_header_size = header_offset + sizeof(header);
+
+		void set_routing_table(std::shared_ptr<routing_table> _table) {
+			table = _table;
+		}
+
+		std::shared_ptr<routing_table> get_routing_table() const {
+			return table;
+		}
+
+		int get_hops_to_live() const {
+			return hops_to_live;
+		}
+
+		void set_hops_to_live(int htl) {
+			hops_to_live = htl;
+		}
+
+		void init() override {
+			wrapped_comm_type::init();
+
+			this->get_node_ref().on_self(basic_node::event_move, [this](event& ev) {
+				if (table) table->node_moved(ev.target->get_id());
 			});
 		}
+
+		void start() override {
+			wrapped_comm_type::start();
+			if (table) table->node_up(this->get_node_ref().get_id());
+		}
+
+		void stop() override {
+			if (table) table->node_down(this->get_node_ref().get_id());
+			wrapped_comm_type::stop();
+		}
+
+		bool receive(std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) override {
+			if (!wrapped_comm_type::receive(data, from)) return false;
+
+			header hdr;
+			this->read_header(*data, header_offset, hdr);
+
+			auto& node = this->get_node_ref();
+			if (hdr.dest_id == node.get_id() || hdr.dest_id == any_neighbor) return true;
+
+			auto next = table ? table->next_hop(node.get_id(), hdr.dest_id) : nullptr;
+			if (!next || hdr.hops_to_live <= 1) {
+				this->fire(basic_comm::event_drop, data, from);
+				return false;
+			}
+
+			// the received frame is shared with the other receivers, so the forwarded one is a copy
+			auto newdata = *data;
+			hdr.hops_to_live--;
+			this->write_header(newdata, header_offset, hdr);
+
+			this->fire(basic_comm::event_forward, data, from);
+			wrapped_comm_type::send_frame(std::move(newdata), next);
+			return false;
+		}
+
+		void send(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
+			assert(false);
+		}
+
+		void route(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
+			route_frame(this->make_frame(frame_header_size, data), to);
+		}
+
+	protected:
+		// a frame a layer above sends straight to a neighbour, or multicasts to several, carries this header too, addressed to them
+		void send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) override {
+			header hdr;
+			hdr.dest_id = to->get_id();
+			hdr.source_id = this->get_node_ref().get_id();
+			hdr.msg_id = message_id++;
+			hdr.hops_to_live = 1;
+
+			this->write_header(frame, header_offset, hdr);
+			wrapped_comm_type::send_frame(std::move(frame), to);
+		}
+
+		void multicast_frame(std::vector<uchar> frame, const basic_comm::node_list& receivers) override {
+			header hdr;
+			hdr.dest_id = any_neighbor;
+			hdr.source_id = this->get_node_ref().get_id();
+			hdr.msg_id = message_id++;
+			hdr.hops_to_live = 1;
+
+			this->write_header(frame, header_offset, hdr);
+			wrapped_comm_type::multicast_frame(std::move(frame), receivers);
+		}
+
+		void route_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) {
+			auto& node = this->get_node_ref();
+			if (to->is_same(node)) return;
+
+			auto next = table ? table->next_hop(node.get_id(), to->get_id()) : nullptr;
+			if (!next) {
+				this->fire(basic_comm::event_drop, std::make_shared<std::vector<uchar>>(std::move(frame)), to);
+				return;
+			}
+
+			header hdr;
+			hdr.dest_id = to->get_id();
+			hdr.source_id = node.get_id();
+			hdr.msg_id = message_id++;
+			hdr.hops_to_live = hops_to_live;
+
+			this->write_header(frame, header_offset, hdr);
+			wrapped_comm_type::send_frame(std::move(frame), next);
+		}
 	};
 
 
 
 
+	// convergecast over a spanning tree: the tree is rooted at the sink (or, without a sink, at the node with the lowest id),
+	// data routed to the root climbs the tree, and values contributed by nodes are aggregated in the network so that
+	// each tree edge carries at most one aggregate message per epoch.
 	template <typename wrapped_comm_type>
 	class spanning_tree_routing : public wrapped_comm_type {
+	public:
+		enum class aggregation_type : uchar {
+			sum,
+			min,
+			max,
+			mean
+		};
+
+		static inline const uint event_aggregate = unique_id();	// fired by the root once per epoch: (double value, uint count)
+
 	protected:
 		enum class message_type : uchar {
+			invalid,		// a zeroed header, never sent
 			notify_root,
 			update_child,
-			send_data
+			send_data,
+			aggregate
 		};
 
 		struct notify_root_data_type {
+			unsigned long long root_rank;
+			uint round;
 			double cost;
-			uint root_id;
 		};
 
 		struct update_child_data_type {
 			uint child_id;
+			bool attach;
+		};
+
+		struct send_data_type {
+			uint dest_id;
+			uint source_id;
+		};
+
+		struct aggregate_data_type {
+			uint count;
+			double sum, min, max;
 		};
 
 		struct header {
 			message_type msg_type;
 			double send_time;
-			std::variant<notify_root_data_type, update_child_data_type> data;
+			union {
+				notify_root_data_type notify_root;
+				update_child_data_type update_child;
+				send_data_type send_data;
+				aggregate_data_type aggregate;
+			} data;
 		};
 
-		bool i_am_root = true;
+	public:
+		static constexpr uint header_offset = wrapped_comm_type::frame_header_size;
+		static constexpr uint frame_header_size = header_offset + sizeof(header);
+
+	protected:
+		bool is_sink = false;
+		double tree_range = 5.;		// in meters
+		std::chrono::duration<double> epoch{ 60. };
+		aggregation_type aggregation = aggregation_type::mean;
+
+		// tree state
+		std::mutex tree_mutex;
+		unsigned long long root_rank = std::numeric_limits<unsigned long long>::max();
 		uint root_id = -1;
+		uint round = 0;
 		double cost_to_root = 0.;
 		std::shared_ptr<basic_node> parent;
 		std::list<uint> children;
 
-		header& prepare_message(message_type type, std::vector<uchar>& data) {
-			header hdr;
+		// partial aggregate of the current epoch, own contributions and children's included
+		std::mutex aggregate_mutex;
+		aggregate_data_type partial;
+
+		// sinks rank before any other node, then lower ids before higher ones
+		unsigned long long own_rank() const {
+			return ((unsigned long long)(is_sink ? 0 : 1) << 32) | this->get_node_ref().get_id();
+		}
+
+		static uint rank2id(unsigned long long rank) {
+			return (uint)(rank & 0xffffffff);
+		}
+
+		void reset_partial() {
+			partial.count = 0;
+			partial.sum = 0.;
+			partial.min = std::numeric_limits<double>::max();
+			partial.max = std::numeric_limits<double>::lowest();
+		}
+
+		void merge_partial(const aggregate_data_type& a) {
+			std::lock_guard lock(aggregate_mutex);
+			partial.count += a.count;
+			partial.sum += a.sum;
+			partial.min = std::min(partial.min, a.min);
+			partial.max = std::max(partial.max, a.max);
+		}
+
+		double aggregate_value(const aggregate_data_type& a) const {
+			switch (aggregation) {
+			case aggregation_type::sum: return a.sum;
+			case aggregation_type::min: return a.min;
+			case aggregation_type::max: return a.max;
+			default: return a.sum / a.count;
+			}
+		}
+
+		std::vector<uchar> prepare_message(message_type type, header& hdr) {
 			hdr.msg_type = type;
 			hdr.send_time = this->get_world_clock_time();
-			this->add_header(data, hdr);
 
-			return this->extract_header<header>(data);
+			std::vector<uchar> frame(frame_header_size);
+			this->write_header(frame, header_offset, hdr);
+			return frame;
 		}
 
-	public:
-		virtual void start() override {
-			wrapped_comm_type::start();
+		void announce() {
+			header hdr;
+			hdr.data.notify_root = { root_rank, round, cost_to_root };
+			wrapped_comm_type::multicast_frame(prepare_message(message_type::notify_root, hdr), this->find_receivers_in_range(tree_range));
+		}
 
-			i_am_root = true;
-			root_id = this->get_node()->get_id();
+		void notify_parent(std::shared_ptr<basic_node> to, bool attach) {
+			header hdr;
+			hdr.data.update_child = { this->get_node_ref().get_id(), attach };
+			wrapped_comm_type::send_frame(prepare_message(message_type::update_child, hdr), to);
+		}
+
+		void become_root() {
+			root_rank = own_rank();
+			root_id = this->get_node_ref().get_id();
 			cost_to_root = 0.;
 			parent = nullptr;
 			children.clear();
+		}
 
-			std::vector<uchar> data;
-			auto& hdr = prepare_message(message_type::notify_root, data);
-			auto& hdr_data = std::get<notify_root_data_type>(hdr.data);
-			hdr_data.root_id = root_id;
-			hdr_data.cost = 0.;
-			this->broadcast_by_distance(data, 5);
+		void on_notify_root(const notify_root_data_type& nr, std::shared_ptr<basic_node> from) {
+			std::shared_ptr<basic_node> old_parent;
+			{
+				std::lock_guard lock(tree_mutex);
+
+				double cost = nr.cost + 1.;	// hop count
+				bool better = nr.root_rank < root_rank
+					|| (nr.root_rank == root_rank && nr.round > round)
+					|| (nr.root_rank == root_rank && nr.round == round && cost < cost_to_root);
+
+				if (!better) {
+					// a neighbor with a worse tree should learn about ours
+					if (nr.root_rank > root_rank) {
+						header hdr;
+						hdr.data.notify_root = { root_rank, round, cost_to_root };
+						wrapped_comm_type::send_frame(prepare_message(message_type::notify_root, hdr), from);
+					}
+					return;
+				}
+
+				if (nr.root_rank != root_rank || nr.round != round) children.clear();
+
+				old_parent = parent;
+				root_rank = nr.root_rank;
+				root_id = rank2id(nr.root_rank);
+				round = nr.round;
+				cost_to_root = cost;
+				parent = from;
+			}
+
+			if (old_parent && !old_parent->is_same(from)) notify_parent(old_parent, false);
+			notify_parent(from, true);
+			announce();
+		}
+
+		void on_update_child(const update_child_data_type& uc) {
+			std::lock_guard lock(tree_mutex);
+
+			children.remove(uc.child_id);
+			if (uc.attach) children.push_back(uc.child_id);
+		}
+
+		void end_epoch() {
+			aggregate_data_type a;
+			{
+				std::lock_guard lock(aggregate_mutex);
+				a = partial;
+				reset_partial();
+			}
+			if (a.count == 0) return;
+
+			std::shared_ptr<basic_node> to;
+			{
+				std::lock_guard lock(tree_mutex);
+				to = parent;
+			}
+
+			if (!to) {
+				this->fire(event_aggregate, aggregate_value(a), a.count);
+				return;
+			}
+
+			header hdr;
+			hdr.data.aggregate = a;
+			wrapped_comm_type::send_frame(prepare_message(message_type::aggregate, hdr), to);
+		}
+
+	public:
+		spanning_tree_routing() {
+			reset_partial();
+		}
+
+		void set_sink(bool s) {
+			is_sink = s;
+		}
+
+		bool get_sink() const {
+			return is_sink;
+		}
+
+		double get_tree_range() const {
+			return tree_range;
+		}
+
+		void set_tree_range(double _range) {
+			tree_range = _range;
+		}
+
+		template <typename _Rep, typename _Period>
+		void set_epoch(std::chrono::duration<_Rep, _Period> e) {
+			epoch = std::chrono::duration_cast<std::chrono::duration<double>>(e);
+		}
+
+		std::chrono::duration<double> get_epoch() const {
+			return epoch;
+		}
+
+		void set_aggregation(aggregation_type a) {
+			aggregation = a;
+		}
+
+		aggregation_type get_aggregation() const {
+			return aggregation;
+		}
+
+		bool is_root() {
+			std::lock_guard lock(tree_mutex);
+			return parent == nullptr;
+		}
+
+		uint get_root_id() {
+			std::lock_guard lock(tree_mutex);
+			return root_id;
+		}
+
+		std::shared_ptr<basic_node> get_parent() {
+			std::lock_guard lock(tree_mutex);
+			return parent;
+		}
+
+		std::list<uint> get_children() {
+			std::lock_guard lock(tree_mutex);
+			return children;
+		}
+
+		double get_cost_to_root() {
+			std::lock_guard lock(tree_mutex);
+			return cost_to_root;
+		}
+
+		// adds a value to the aggregate of the current epoch
+		void contribute(double value) {
+			merge_partial({ 1, value, value, value });
+		}
+
+		// restarts tree construction from this node as a new root, e.g. after nodes died
+		void rebuild() {
+			{
+				std::lock_guard lock(tree_mutex);
+				if (parent) return;
+
+				round++;
+				become_root();
+			}
+			announce();
 		}
 
-		virtual bool receive(std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) override {
+		void init() override {
+			wrapped_comm_type::init();
+
+			this->on_self(entity::event_first_start, [this](event&) {
+				this->timer(epoch, true, [this](event&) {
+					end_epoch();
+				});
+			});
+		}
+
+		void start() override {
+			wrapped_comm_type::start();
+
+			{
+				std::lock_guard lock(tree_mutex);
+				round++;	// never reset: a restarted root must outrank the tree it left behind
+				become_root();
+			}
+			announce();
+		}
+
+		bool receive(std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) override {
 			if (!wrapped_comm_type::receive(data, from)) return false;
 
-			auto& hdr = this->extract_header<header>(*data);
-			auto& hdr_data = std::get<notify_root_data_type>(hdr.data);
-			if (hdr.msg_type == message_type::notify_root) {
-				if (hdr_data.root_id < root_id) {
-					i_am_root = false;
-					root_id = hdr_data.root_id;
-					cost_to_root = hdr_data.cost + this->get_world_clock_time() - hdr.send_time;
-					parent = from;
-
-					std::vector<uchar> data2;
-					auto& hdr2 = prepare_message(message_type::update_child, data2);
-					auto& hdr2_data = std::get<update_child_data_type>(hdr2.data);
-					hdr2_data.child_id = this->get_node()->get_id();
-					wrapped_comm_type::send(data2, parent);
-
-					std::vector<uchar> data3;
-					auto& hdr3 = prepare_message(message_type::notify_root, data3);
-					auto& hdr3_data = std::get<notify_root_data_type>(hdr3.data);
-					hdr3_data.root_id = root_id;
-					hdr3_data.cost = 0.;
-					this->broadcast_by_distance(data3, 5);
-				}
-				else {
-					std::vector<uchar> data2;
-					auto& hdr2 = prepare_message(message_type::notify_root, data2);
-					auto& hdr2_data = std::get<notify_root_data_type>(hdr2.data);
-					hdr2_data.root_id = root_id;
-					hdr2_data.cost = cost_to_root;
-					wrapped_comm_type::send(data2, parent);
-				}
+			header hdr;
+			this->read_header(*data, header_offset, hdr);
+
+			switch (hdr.msg_type) {
+			case message_type::notify_root:
+				on_notify_root(hdr.data.notify_root, from);
+				return false;
+
+			case message_type::update_child:
+				on_update_child(hdr.data.update_child);
+				return false;
+
+			case message_type::aggregate:
+				merge_partial(hdr.data.aggregate);
+				return false;
+
+			case message_type::send_data:
+				break;
 
+			default:
+				this->fire(basic_comm::event_drop, data, from);
+				return false;
 			}
-			else if (hdr.msg_type == message_type::update_child) {
 
+			if (hdr.data.send_data.dest_id == this->get_node_ref().get_id() || hdr.data.send_data.dest_id == any_neighbor) return true;
+
+			auto next = get_parent();
+			if (!next) {
+				this->fire(basic_comm::event_drop, data, from);
+				return false;
 			}
 
+			this->fire(basic_comm::event_forward, data, from);
+			wrapped_comm_type::send_frame(*data, next);
+			return false;
+		}
+
+		void send(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
+			assert(false);
+		}
+
+		// only destinations up the tree (typically the root) can be reached
+		void route(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) override {
+			route_frame(this->make_frame(frame_header_size, data), to);
+		}
+
+	protected:
+		// a frame a layer above sends straight to a neighbour, or multicasts to several, carries this header too, addressed to them
+		void send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) override {
+			header hdr;
+			hdr.msg_type = message_type::send_data;
+			hdr.send_time = this->get_world_clock_time();
+			hdr.data.send_data = { to->get_id(), this->get_node_ref().get_id() };
+
+			this->write_header(frame, header_offset, hdr);
+			wrapped_comm_type::send_frame(std::move(frame), to);
+		}
+
+		void multicast_frame(std::vector<uchar> frame, const basic_comm::node_list& receivers) override {
+			header hdr;
+			hdr.msg_type = message_type::send_data;
+			hdr.send_time = this->get_world_clock_time();
+			hdr.data.send_data = { any_neighbor, this->get_node_ref().get_id() };
+
+			this->write_header(frame, header_offset, hdr);
+			wrapped_comm_type::multicast_frame(std::move(frame), receivers);
+		}
+
+		void route_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to) {
+			if (to->is_same(this->get_node_ref())) return;
+
+			auto next = get_parent();
+			if (!next) {
+				this->fire(basic_comm::event_drop, std::make_shared<std::vector<uchar>>(std::move(frame)), to);
+				return;
+			}
+
+			header hdr;
+			hdr.msg_type = message_type::send_data;
+			hdr.send_time = this->get_world_clock_time();
+			hdr.data.send_data = { to->get_id(), this->get_node_ref().get_id() };
+
+			this->write_header(frame, header_offset, hdr);
+			wrapped_comm_type::send_frame(std::move(frame), next);
 		}
 	};
 }
\ No newline at end of file
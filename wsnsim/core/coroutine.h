@@ -0,0 +1,234 @@
+#pragma once
+
+#include "wsnsim.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+
+
+namespace wsn {
+
+
+
+	// node logic written as a coroutine, woken by the world's scheduler instead of a thread per timer
+	// and resumed on its owner's mailbox, never concurrently with the owner's handlers:
+	//
+	//	behaviour run(basic_node& node) {
+	//		while (true) {
+	//			co_await sleep_for(5min);
+	//			...
+	//			co_await next(node, basic_battery::event_empty);
+	//		}
+	//	}
+	//
+	//	spawn(*this, run(get_node_ref()));
+	//
+	// a frame holding shared_ptrs to its own owner keeps it alive while waiting, hence the reference.
+	// the frame lives as long as something is going to resume it: a pending wake-up or an event
+	// subscription, or a copy of the behaviour. it is dropped without resuming once its owner is gone,
+	// and its wake-ups are held back while the owner is stopped, like those of a timer synchronized
+	// with start/stop. an exception escaping the routine ends it and is kept for get_exception().
+	class behaviour {
+	public:
+		struct promise_type;
+		using handle_type = std::coroutine_handle<promise_type>;
+
+	protected:
+		struct routine {
+			handle_type h;
+			std::exception_ptr exception;
+
+			~routine() {
+				if (h) h.destroy();
+			}
+		};
+
+	public:
+		struct promise_type {
+			std::weak_ptr<routine> self;
+			handle<entity> owner;
+			scheduler* sched = nullptr;
+
+			behaviour get_return_object() {
+				auto r = std::make_shared<routine>();
+				r->h = handle_type::from_promise(*this);
+				self = r;
+				return behaviour(r);
+			}
+
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_always final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() {
+				auto r = self.lock();
+				if (r) r->exception = std::current_exception();
+			}
+		};
+
+	protected:
+		std::shared_ptr<routine> r;
+
+		explicit behaviour(std::shared_ptr<routine> _r)
+			: r(std::move(_r))
+		{}
+
+		template <typename... Args>
+		static void when(entity& source, uint event_id, std::shared_ptr<routine> r, std::function<void(event&)> then);
+
+		static void resume(std::shared_ptr<routine> r) {
+			// may run on the scheduler or another actor's mailbox, which do not keep the owner alive
+			auto sp = r->h.promise().owner.lock();
+			if (!sp) return;
+
+			auto owner = sp.get();
+			owner->post([r = std::move(r), owner]() mutable {
+				if (!owner->is_started()) {
+					when(*owner, entity::event_start, std::move(r), nullptr);
+					return;
+				}
+
+				r->h.resume();
+			});
+		}
+
+		friend void spawn(entity& owner, const behaviour& b);
+		template <typename... Args> friend class next;
+		friend class sleep_until;
+
+	public:
+		bool done() const {
+			return r->h.done();
+		}
+
+		// what ended the routine, null while it runs or once it returned
+		std::exception_ptr get_exception() const {
+			return r->exception;
+		}
+	};
+
+
+	// starts a behaviour owned by an entity, on the scheduler of the entity's world
+	inline void spawn(entity& owner, const behaviour& b) {
+		auto& p = b.r->h.promise();
+		p.owner = &owner;
+		p.sched = &owner.get_world_ptr()->get_scheduler();
+		p.sched->post([r = b.r]() mutable {
+			behaviour::resume(std::move(r));
+		});
+	}
+
+
+	// resumes when the scheduler's time reaches t
+	class sleep_until {
+	protected:
+		double t;
+
+	public:
+		explicit sleep_until(double _t)
+			: t(_t)
+		{}
+
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		void await_suspend(behaviour::handle_type h) {
+			auto& p = h.promise();
+			p.sched->post_at(t, [r = p.self.lock()]() mutable {
+				behaviour::resume(std::move(r));
+			});
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+
+	// resumes after some simulated time
+	class sleep_for {
+	protected:
+		double dt;
+
+	public:
+		template <typename _Rep, typename _Period>
+		explicit sleep_for(std::chrono::duration<_Rep, _Period> dur)
+			: dt(std::chrono::duration<double>(dur).count())
+		{}
+
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		void await_suspend(behaviour::handle_type h) {
+			auto& p = h.promise();
+			sleep_until(p.sched->now() + dt).await_suspend(h);
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+
+	// resumes on the next occurrence of an event on an entity or bubbling up to it.
+	// Args are the extra arguments the event is fired with, e.g. next<double>(*node, basic_battery::event_consume)
+	template <typename... Args>
+	class next {
+	protected:
+		entity& source;
+		uint event_id;
+		event ev;
+
+	public:
+		next(entity& _source, uint _event_id)
+			: source(_source), event_id(_event_id)
+		{}
+
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		void await_suspend(behaviour::handle_type h) {
+			behaviour::when<Args...>(source, event_id, h.promise().self.lock(), [this](event& _ev) {
+				ev = _ev;
+			});
+		}
+
+		event await_resume() const noexcept {
+			return ev;
+		}
+	};
+
+
+	// one-shot subscription: the first occurrence hands the routine back to the scheduler and
+	// the subscription is removed from there, not from inside the event's dispatch
+	template <typename... Args>
+	void behaviour::when(entity& source, uint event_id, std::shared_ptr<routine> r, std::function<void(event&)> then) {
+		struct waiting {
+			std::atomic<bool> spent = false;
+			uint key = 0;
+			std::shared_ptr<routine> r;
+		};
+
+		auto w = std::make_shared<waiting>();
+		w->r = std::move(r);
+		auto sched = w->r->h.promise().sched;
+		auto src = source.get_handle();
+
+		w->key = source.on(event_id, [w, sched, src, then](event& ev, Args...) {
+			if (w->spent.exchange(true)) return;
+			if (then) then(ev);
+
+			sched->post([r = std::move(w->r)]() mutable {
+				resume(std::move(r));
+			});
+
+			sched->post([w, src]() {
+				auto p = src.get();
+				if (p) p->unbind(w->key);
+			});
+		});
+	}
+
+
+
+}
+
+#endif
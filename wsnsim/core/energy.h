@@ -0,0 +1,232 @@
+#pragma once
+
+#include "wsnsim.h"
+#include <map>
+#include <limits>
+#include <mutex>
+
+
+namespace wsn {
+
+
+
+	// per node account of the energy spent in each state of the node (radio sleeping, listening...), integrated
+	// between state changes, plus the bursts of activity the node's comm and sensor report: frames sent and
+	// received, measurements. nothing ticks: the energy reaches the battery when it is queried or flushed,
+	// or when the amount not yet flushed reaches a threshold.
+	//
+	//	auto ledger = make_entity<energy_ledger>();
+	//	ledger->set_power(energy_ledger::state_sleep, 15e-6);
+	//	ledger->set_power(energy_ledger::state_tx, 52e-3);
+	//	ledger->attach(node);
+	//	...
+	//	ledger->set_state(energy_ledger::state_idle);
+	class energy_ledger : public node_component {
+	public:
+		static inline const uint state_sleep = unique_id();
+		static inline const uint state_idle = unique_id();
+		static inline const uint state_rx = unique_id();
+		static inline const uint state_tx = unique_id();
+		static inline const uint state_sense = unique_id();
+
+		static inline const uint event_flush = unique_id();	// fired with the energy handed to the battery, in J
+
+		class account {
+		public:
+			double time = 0;	// s
+			double energy = 0;	// J
+		};
+
+	protected:
+		std::map<uint, double> powers;		// W
+		std::map<uint, account> accounts;
+
+		uint state = state_sleep;
+		double since = -1;		// clock time the current state started being accounted from
+		double pending = 0;		// J not flushed yet, up to since
+
+		double threshold = std::numeric_limits<double>::infinity();
+		double reference_power = 1.;
+		double bitrate = 250000.;
+		double sense_time = 0.;
+
+		std::vector<uint> keys;
+		std::weak_ptr<std::vector<uchar>> last_frame;
+		uint threshold_timer = 0;
+
+		// the node's handlers, the threshold timer and callers of the public api all update the ledger.
+		// the helpers below expect it held, the battery and event_flush handlers run without it
+		mutable std::mutex ledger_mutex;
+
+		double get_power(uint s) const {
+			auto itr = powers.find(s);
+			return itr == powers.end() ? 0. : itr->second;
+		}
+
+		// accounts the current state up to now
+		void settle() {
+			if (!get_world_ptr()->get_clock().is_started()) return;
+
+			double now = get_world_clock_time();
+			if (since >= 0) {
+				double dt = now - since;
+				auto& a = accounts[state];
+				a.time += dt;
+				a.energy += dt * get_power(state);
+				pending += dt * get_power(state);
+			}
+			since = now;
+		}
+
+		// a burst on top of the current state, true when it is time to flush
+		bool add(uint s, double duration) {
+			settle();
+
+			double e = duration * get_power(s);
+			auto& a = accounts[s];
+			a.time += duration;
+			a.energy += e;
+			pending += e;
+
+			return check_threshold();
+		}
+
+		// true when the pending energy reached the threshold, otherwise arms the timer for when it will
+		bool check_threshold() {
+			if (threshold_timer) stop_timer(threshold_timer);
+			threshold_timer = 0;
+
+			if (pending >= threshold) return true;
+
+			double p = get_power(state);
+			if (p <= 0 || !std::isfinite(threshold)) return false;
+
+			threshold_timer = timer_once(std::chrono::duration<double>((threshold - pending) / p), false, [this](event&) {
+				flush();
+			});
+			return false;
+		}
+
+		void flush_if(bool due, std::unique_lock<std::mutex>& lock) {
+			lock.unlock();
+			if (due) flush();
+		}
+
+	public:
+		~energy_ledger() override {
+			detach();
+		}
+
+		void set_power(uint s, double watts) {
+			std::lock_guard lock(ledger_mutex);
+			if (since >= 0) settle();
+			powers[s] = watts;
+		}
+
+		void set_state(uint s) {
+			std::unique_lock lock(ledger_mutex);
+			settle();
+			state = s;
+			flush_if(check_threshold(), lock);
+		}
+
+		uint get_state() const {
+			std::lock_guard lock(ledger_mutex);
+			return state;
+		}
+
+		// sending a frame is a tx burst of its airtime, receiving one an rx burst
+		void set_bitrate(double bps) {
+			std::lock_guard lock(ledger_mutex);
+			bitrate = bps;
+		}
+
+		// a measurement is a sense burst of this duration
+		void set_sense_time(double t) {
+			std::lock_guard lock(ledger_mutex);
+			sense_time = t;
+		}
+
+		// energy handed to the battery once it has piled up that much, in J
+		void set_threshold(double j) {
+			std::lock_guard lock(ledger_mutex);
+			threshold = j;
+		}
+
+		// the power drawn by the battery's consume(T) for T = 1 s, to turn joules into battery time
+		void set_reference_power(double watts) {
+			std::lock_guard lock(ledger_mutex);
+			reference_power = watts;
+		}
+
+		void attach(std::shared_ptr<basic_node> _node) {
+			detach();
+			set_node(_node);
+
+			keys.push_back(_node->on(basic_comm::event_send, [this](event&, std::shared_ptr<std::vector<uchar>> frame, std::shared_ptr<basic_node>) {
+				std::unique_lock lock(ledger_mutex);
+
+				// a multicast is one transmission for all its receivers
+				if (last_frame.lock() == frame) return;
+				last_frame = frame;
+
+				flush_if(add(state_tx, frame->size() * 8. / bitrate), lock);
+			}));
+
+			keys.push_back(_node->on(basic_comm::event_receive, [this](event&, std::shared_ptr<std::vector<uchar>> frame, std::shared_ptr<basic_node>) {
+				std::unique_lock lock(ledger_mutex);
+				flush_if(add(state_rx, frame->size() * 8. / bitrate), lock);
+			}));
+
+			keys.push_back(_node->on(basic_sensor::event_measure, [this](event&, std::any, double) {
+				std::unique_lock lock(ledger_mutex);
+				flush_if(add(state_sense, sense_time), lock);
+			}));
+		}
+
+		void detach() {
+			auto n = node.get();
+			if (n) {
+				for (auto k : keys) n->unbind(k);
+			}
+			keys.clear();
+		}
+
+		// hands the energy spent so far to the node's battery
+		void flush() {
+			double e, t;
+			{
+				std::lock_guard lock(ledger_mutex);
+				settle();
+				if (pending <= 0) return;
+
+				e = pending;
+				t = e / reference_power;
+				pending = 0;
+				check_threshold();
+			}
+
+			get_node_ref().get_battery()->consume(t);
+			fire(event_flush, e);
+		}
+
+		// total energy spent, in J; flushes it to the battery
+		double get_energy() {
+			flush();
+
+			std::lock_guard lock(ledger_mutex);
+			double total = 0;
+			for (auto& a : accounts) total += a.second.energy;
+			return total;
+		}
+
+		account get_account(uint s) {
+			std::lock_guard lock(ledger_mutex);
+			settle();
+
+			auto itr = accounts.find(s);
+			return itr == accounts.end() ? account() : itr->second;
+		}
+	};
+
+}
@@ -27,6 +27,8 @@ namespace wsn::power {
 	protected:
 		double area = 5e-4,
 			efficiency = .7;
+		bool cached = true;	// sun positions from sun::get_cache()
+		handle<irradiance_ambient> irradiance;	// when set, used instead of sun
 
 	public:
 		void set_area(double _area) {
@@ -37,17 +39,25 @@ namespace wsn::power {
 			efficiency = _eff;
 		}
 
-		double get_max_power() const override {
-			auto world = get_world();
-			auto frame = world->get_reference_frame();
+		void set_cached(bool c) {
+			cached = c;
+		}
 
-			auto node = get_node();
-			auto loc = node->get_location();
+		void set_irradiance(std::shared_ptr<irradiance_ambient> _irradiance) {
+			irradiance = _irradiance;
+		}
+
+		double get_max_power() const override {
+			auto world = get_world_ptr();
+			auto& frame = world->get_reference_frame();
 
 			double lat, lon, alt;
-			frame.local2lla(loc.x, loc.y, loc.z, lat, lon, alt);
+			get_node_ref().get_lla(lat, lon, alt);
 
-			double rad = sun::get_radiation_power(lat, lon, frame.get_timezone(), world->get_clock().reference_now());
+			auto t = world->get_clock().reference_now();
+			auto irr = irradiance.lock();
+			double rad = irr ? irr->get_power(lat, lon, frame.get_timezone(), t)
+				: cached ? sun::get_cached_radiation_power(lat, lon, frame.get_timezone(), t) : sun::get_radiation_power(lat, lon, frame.get_timezone(), t);
 			return rad * area*efficiency;
 		}
 	};
@@ -51,16 +51,13 @@ namespace wsn::sensor {
 	template <typename wrapped_sensor_type>
 	class with_ambient : public wrapped_sensor_type {
 	protected:
-		std::weak_ptr<basic_ambient> ambient;
+		handle<basic_ambient> ambient;
 
 		void compute_value(std::any& value) const override {
-			auto node = this->get_node();
-			assert(node);
-
 			auto am = ambient.lock();
 			assert(am);
 
-			am->get_value(node->get_location(), value);
+			am->get_value(this->get_node_ref().get_location(), value);
 		}
 
 	public:
@@ -67,6 +67,7 @@ namespace wsn {
 			invmat(2, i) = iz[i];
 		}
 		mat = invmat.inverse();
+		version++;
 	}
 
 
@@ -95,6 +96,7 @@ namespace wsn {
 			invmat(2, i) = iz[i];
 		}
 		mat = invmat.inverse();
+		version++;
 	}
 
 	vector3 reference_frame::zenith_dir() const
@@ -128,6 +130,16 @@ namespace wsn {
 		global2lla(xg, yg, zg, lat, lon, alt);
 	}
 
+	void reference_frame::local2lla(const Eigen::Matrix3Xd& local, Eigen::Matrix3Xd& lla) const
+	{
+		Eigen::Matrix3Xd global = (invmat * local).colwise() + org;
+
+		lla.resize(3, local.cols());
+		for (Eigen::Index i = 0; i < global.cols(); i++) {
+			global2lla(global(0, i), global(1, i), global(2, i), lla(0, i), lla(1, i), lla(2, i));
+		}
+	}
+
 	void reference_frame::global2local(double xg, double yg, double zg, double& xl, double& yl, double& zl) const
 	{
 		vector3 v = mat * (vector3(xg, yg, zg) - org);
@@ -222,6 +234,78 @@ namespace wsn {
 
 
 
+	void entity_registry::acquire(entity* e, uint& index, uint& generation)
+	{
+		std::lock_guard lock(mutex);
+
+		if (free_slots.empty()) {
+			index = slot_count++;
+
+			auto c = index >> chunk_bits;
+			if (c >= max_chunks) throw std::length_error("too many entities");
+
+			if (!chunks[c].load(std::memory_order_relaxed)) {
+				chunk_storage.emplace_back(new slot[chunk_size]);
+				for (uint i = 0; i < chunk_size; i++)
+					chunk_storage.back()[i].generation.store(first_generation, std::memory_order_relaxed);
+				chunks[c].store(chunk_storage.back().get(), std::memory_order_release);
+			}
+		}
+		else {
+			index = free_slots.back();
+			free_slots.pop_back();
+		}
+
+		auto& sl = chunks[index >> chunk_bits].load(std::memory_order_relaxed)[index & (chunk_size - 1)];
+		sl.ptr.store(e, std::memory_order_release);
+		generation = sl.generation.load(std::memory_order_relaxed);
+		live_count++;
+	}
+
+	void entity_registry::release(uint index)
+	{
+		std::scoped_lock lock(mutex, pin_mutex(index));
+
+		auto& sl = chunks[index >> chunk_bits].load(std::memory_order_relaxed)[index & (chunk_size - 1)];
+
+		// generation 0 marks null handles
+		auto g = sl.generation.load(std::memory_order_relaxed) + 1;
+		sl.generation.store(g == 0 ? 1 : g, std::memory_order_release);
+		sl.ptr.store(nullptr, std::memory_order_release);
+
+		free_slots.push_back(index);
+		if (--live_count == 0) reclaim();
+	}
+
+	// with no entity left, no handler can be resolving a handle
+	void entity_registry::reclaim()
+	{
+		uint g = first_generation;
+		for (uint i = 0; i < slot_count; i++) {
+			auto& sl = chunks[i >> chunk_bits].load(std::memory_order_relaxed)[i & (chunk_size - 1)];
+			g = std::max(g, sl.generation.load(std::memory_order_relaxed));
+		}
+		first_generation = (g + 1 == 0) ? 1 : g + 1;
+
+		for (uint c = 0; c < chunk_storage.size(); c++) {
+			chunks[c].store(nullptr, std::memory_order_release);
+		}
+		chunk_storage.clear();
+		free_slots.clear();
+		slot_count = 0;
+	}
+
+	std::shared_ptr<entity> entity_registry::lock(uint index, uint generation)
+	{
+		std::lock_guard lock(pin_mutex(index));
+
+		auto e = resolve(index, generation);
+		if (!e) return nullptr;
+
+		// an entity being destroyed is still in its slot, but its refcount is already 0
+		return std::static_pointer_cast<entity>(e->weak_from_this().lock());
+	}
+
 	void entity::start()
 	{
 		if (started) return;
@@ -233,28 +317,156 @@ namespace wsn {
 
 		started = true;
 		start_time = get_world_clock_time();
+
+		// timers synchronized with start/stop that stopped ticking meanwhile start a new period
+		{
+			std::lock_guard lock(timer_list_mutex);
+			auto now = get_world_ptr()->get_scheduler().now();
+			for (auto& inf : timer_list) {
+				std::lock_guard lock2(inf->mutex);
+				if (inf->status != status_type::paused) continue;
+
+				inf->status = status_type::running;
+				arm_timer(inf, now + inf->period);
+			}
+		}
+
 		fire(event_start);
 	}
 
+	void entity::stop()
+	{
+		if (!started) return;
+
+		started = false;
+
+		// timers synchronized with start/stop leave their periodic groups right away
+		{
+			std::lock_guard lock(timer_list_mutex);
+			for (auto& inf : timer_list) {
+				std::lock_guard lock2(inf->mutex);
+				if (!inf->sync_start_stop || inf->status != status_type::running) continue;
+
+				inf->status = status_type::paused;
+				inf->generation++;
+			}
+		}
+
+		fire(event_stop);
+	}
+
+	void entity::post(std::function<void()> f)
+	{
+		auto& box = get_mailbox();
+
+		// nothing runs for an owner already being destroyed
+		auto keep = std::static_pointer_cast<entity>(box.get_owner().weak_from_this().lock());
+		if (!keep) return;
+
+		// not in a world yet, or not anymore: nothing to run the mailbox on
+		auto world = get_world_ptr();
+		if (!world) return;
+
+		if (box.push(std::move(f)))
+			world->get_executor().submit(&box, std::move(keep));
+	}
+
+	std::unique_lock<std::recursive_mutex> entity::lock_dispatch(entity& target)
+	{
+		if (&get_mailbox() == &target.get_mailbox()) return {};
+
+		auto world = get_world_ptr();
+		if (!world) return {};
+
+		return std::unique_lock(world->dispatch_mutex);
+	}
+
+	uint entity::add_timer(double period, bool periodic, bool sync_start_stop, std::function<bool(event&)> callback)
+	{
+		auto inf = std::allocate_shared<timer_info>(arena_allocator<timer_info>(arena, true));
+		inf->key = unique_id();
+		inf->sync_start_stop = sync_start_stop;
+		inf->period = period;
+		inf->periodic = periodic;
+		inf->callback = std::move(callback);
+		inf->status = (!sync_start_stop || started) ? status_type::running : status_type::paused;
+
+		{
+			std::lock_guard lock(timer_list_mutex);
+			timer_list.push_back(inf);
+		}
+
+		if (inf->status == status_type::running) {
+			std::lock_guard lock(inf->mutex);
+			arm_timer(inf, get_world_ptr()->get_scheduler().now() + inf->period);
+		}
+
+		return inf->key;
+	}
+
+	void entity::arm_timer(const std::shared_ptr<timer_info>& inf, double due)
+	{
+		auto generation = ++inf->generation;
+		auto& sched = get_world_ptr()->get_scheduler();
+
+		auto tick = [inf, generation, self = get_handle()]() -> bool {
+			if (inf->generation != generation) return false;
+
+			auto e = self.get();
+			if (!e) return false;
+
+			e->post([inf, generation, e]() {
+				e->run_timer(inf, generation);
+			});
+			return true;
+		};
+
+		if (inf->periodic)
+			sched.post_periodic(due, inf->period, tick);
+		else
+			sched.post_at(due, tick);
+	}
+
+	void entity::run_timer(const std::shared_ptr<timer_info>& inf, uint generation)
+	{
+		{
+			std::lock_guard lock(inf->mutex);
+			if (generation != inf->generation || inf->status != status_type::running) return;
+
+			// stopped meanwhile: the next start arms it again
+			if (inf->sync_start_stop && !started) {
+				inf->status = status_type::paused;
+				inf->generation++;
+				return;
+			}
+		}
+
+		event ev;
+		ev.event_id = event_timer;
+		ev.target = this;
+		if (!inf->callback(ev))
+			stop_timer(inf->key);
+	}
+
 	double entity::get_local_clock_time() const
 	{
 		if (!started) throw std::logic_error("clock not started");
-		return get_world()->get_clock().clock_now() - start_time;
+		return get_world_ptr()->get_clock().clock_now() - start_time;
 	}
 
 	double entity::get_world_clock_time() const
 	{
-		return get_world()->get_clock().clock_now();
+		return get_world_ptr()->get_clock().clock_now();
 	}
 
 	std::chrono::system_clock::time_point entity::get_reference_time() const
 	{
-		return get_world()->get_clock().reference_now();
+		return get_world_ptr()->get_clock().reference_now();
 	}
 
 	std::chrono::system_clock::time_point entity::get_system_time() const
 	{
-		return get_world()->get_clock().system_now();
+		return get_world_ptr()->get_clock().system_now();
 	}
 
 
@@ -263,39 +475,85 @@ namespace wsn {
 
 
 
-	void basic_comm::send(const std::vector<uchar>& data, std::shared_ptr<basic_node> to)
+	void basic_comm::send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to)
+	{
+		auto rframe = std::make_shared<std::vector<uchar>>(std::move(frame));
+
+		fire(event_send, rframe, to);
+
+		deliver(rframe, { to });
+	}
+
+	void basic_comm::multicast_frame(std::vector<uchar> frame, const node_list& receivers)
 	{
-		auto rdata = make_shared_data(data);
+		if (receivers.empty()) return;
 
-		fire(event_send, rdata, to);
+		auto rframe = std::make_shared<std::vector<uchar>>(std::move(frame));
+		for (auto& to : receivers) {
+			fire(event_send, rframe, to);
+		}
 
-		std::thread([rdata, this, to] {
-			to->get_comm()->receive(rdata, get_node());
-		}).detach();
+		deliver(rframe, receivers);
+	}
+
+	void basic_comm::deliver(std::shared_ptr<std::vector<uchar>> frame, const node_list& receivers)
+	{
+		auto from = get_node();
+		for (auto& to : receivers) {
+			auto comm = to->get_comm().get();
+			comm->post([frame, from, comm]() {
+				// a radio not started yet, or stopped while the frame was on its way, hears nothing
+				if (comm->is_started()) comm->receive(frame, from);
+			});
+		}
+	}
+
+	basic_comm::node_list basic_comm::find_receivers(std::function<bool(basic_node*)> condition) const
+	{
+		auto self = &get_node_ref();
+
+		node_list receivers;
+		get_network()->find_nodes([&self, &condition](auto node) {
+			return node != self && condition(node);
+		}, receivers);
+		return receivers;
+	}
+
+	basic_comm::node_list basic_comm::find_receivers_in_range(double range) const
+	{
+		auto& loc = get_node_ref().get_location();
+
+		return find_receivers([&loc, range](auto node) {
+			return node->get_location().distance_to(loc) <= range;
+		});
 	}
 
 	void basic_comm::broadcast(const std::vector<uchar>& data, std::function<bool(std::shared_ptr<basic_node>)> condition,
 		std::function<void(std::shared_ptr<basic_node>)> sender)
 	{
-		auto network = get_network();
-		auto nodes = network->find_nodes(condition);
-		std::for_each(std::execution::par, nodes.begin(), nodes.end(), [&data, this, sender](auto& node) {
-			if (!is_same(node->get_comm())) {
-				if (sender == nullptr)
-					send(data, node);
-				else sender(node);
-			}
+		auto receivers = find_receivers([&condition](basic_node* node) {
+			return condition(std::static_pointer_cast<basic_node>(node->shared_from_this()));
 		});
+		send_to_receivers(data, receivers, sender);
 	}
 
-	void basic_comm::broadcast_by_distance(const std::vector<uchar>& data, double range,
+	void basic_comm::send_to_receivers(const std::vector<uchar>& data, const node_list& receivers,
 		std::function<void(std::shared_ptr<basic_node>)> sender)
 	{
-		auto& loc = get_node()->get_location();
+		if (sender == nullptr) {
+			multicast(data, receivers);
+			return;
+		}
 
-		broadcast(data, [&loc, range](auto node) {
-			return node->get_location().distance_to(loc) <= range;
-		}, sender);
+		for (auto& node : receivers) {
+			sender(node);
+		}
+	}
+
+	void basic_comm::broadcast_by_distance(const std::vector<uchar>& data, double range,
+		std::function<void(std::shared_ptr<basic_node>)> sender)
+	{
+		send_to_receivers(data, find_receivers_in_range(range), sender);
 	}
 
 
@@ -306,17 +564,27 @@ namespace wsn {
 
 	std::shared_ptr<basic_network> node_component::get_network() const
 	{
-		return get_node()->get_network();
+		return get_node_ref().get_network();
 	}
 
 	std::shared_ptr<basic_world> node_component::get_world()
 	{
-		return get_node()->get_world();
+		return get_node_ref().get_world();
 	}
 
 	std::shared_ptr<const basic_world> node_component::get_world() const
 	{
-		return get_node()->get_world();
+		return get_node_ref().get_world();
+	}
+
+	basic_world* node_component::get_world_ptr() const
+	{
+		return get_node_ref().get_world_ptr();
+	}
+
+	mailbox& node_component::get_mailbox()
+	{
+		return get_node_ref().get_mailbox();
 	}
 
 
@@ -326,9 +594,6 @@ namespace wsn {
 
 	void basic_sensor::measure()
 	{
-		auto node = get_node();
-		auto network = node->get_network();
-
 		compute_value(last_value);
 		last_time = get_world_clock_time();
 		fire(event_measure, last_value, last_time);
@@ -349,6 +614,43 @@ namespace wsn {
 		return get_network()->get_world();
 	}
 
+	basic_world* basic_node::get_world_ptr() const
+	{
+		auto net = network.get();
+		return net ? net->get_world_ptr() : nullptr;
+	}
+
+	void basic_node::get_lla(double& lat, double& lon, double& alt) const
+	{
+		auto& frame = get_world_ptr()->get_reference_frame();
+
+		std::lock_guard lock(lla_mutex);
+		if (lla_frame != frame.get_version()) {
+			frame.local2lla(loc.x, loc.y, loc.z, lla[0], lla[1], lla[2]);
+			lla_frame = frame.get_version();
+		}
+
+		lat = lla[0];
+		lon = lla[1];
+		alt = lla[2];
+	}
+
+	void basic_node::start()
+	{
+		entity::start();
+
+		auto net = network.get();
+		if (net) net->set_active(*this, true);
+	}
+
+	void basic_node::stop()
+	{
+		entity::stop();
+
+		auto net = network.get();
+		if (net && !net->pausing) net->set_active(*this, false);
+	}
+
 
 
 
@@ -365,9 +667,11 @@ namespace wsn {
 
 	void basic_network::stop()
 	{
+		pausing = true;
 		std::for_each(std::execution::par, nodes.begin(), nodes.end(), [](auto& node) {
 			node->stop();
 		});
+		pausing = false;
 
 		entity::stop();
 	}
@@ -8,11 +8,17 @@
 #include <algorithm>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <any>
 #include <chrono>
 #include <execution>
 #include <condition_variable>
+#include <deque>
 #include <random>
+#include <cstring>
+#include <atomic>
+#include <memory_resource>
+#include <limits>
 
 
 #include "../lib/utilities.h"
@@ -44,6 +50,7 @@ namespace wsn {
 	using vector3 = Eigen::Vector3d;
 
 	class entity;
+	class mailbox;
 	class basic_node;
 	class basic_network;
 	class basic_world;
@@ -55,7 +62,7 @@ namespace wsn {
 
 	template <typename type = uint>
 	type unique_id() {
-		static type id = 1;
+		static std::atomic<type> id = 1;	// timers and subscriptions are made from the executor's workers
 		return id++;
 	}
 
@@ -179,11 +186,86 @@ namespace wsn {
 
 
 
+	// civil date and time at a fixed offset from UTC, with integer arithmetic on the days since the epoch
+	// instead of the C runtime's timezone database: the same on every platform, and whatever the host's timezone.
+	// proleptic gregorian calendar, see http://howardhinnant.github.io/date_algorithms.html
+	class calendar {
+	public:
+		struct date_time {
+			int year, month, day;	// month and day from 1
+			int hour, minute;
+			double second;
+			int yday;				// day of the year, from 1
+			int wday;				// day of the week, from 0 on sunday
+		};
+
+	protected:
+		std::chrono::system_clock::duration offset;
+
+	public:
+		explicit calendar(double timezone = 0.)	// hours ahead of UTC
+			: offset(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::duration<double>(timezone * 3600)))
+		{}
+
+		static long long days_from_civil(long long y, int m, int d) {
+			y -= m <= 2;
+			long long era = (y >= 0 ? y : y - 399) / 400;
+			long long yoe = y - era * 400;
+			long long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+			long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+			return era * 146097 + doe - 719468;
+		}
+
+		static void civil_from_days(long long z, int& y, int& m, int& d) {
+			z += 719468;
+			long long era = (z >= 0 ? z : z - 146096) / 146097;
+			long long doe = z - era * 146097;
+			long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+			long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+			long long mp = (5 * doy + 2) / 153;
+			d = (int)(doy - (153 * mp + 2) / 5 + 1);
+			m = (int)(mp < 10 ? mp + 3 : mp - 9);
+			y = (int)(yoe + era * 400 + (m <= 2));
+		}
+
+		date_time to_civil(std::chrono::system_clock::time_point t) const {
+			auto local = t.time_since_epoch() + offset;
+			long long secs = std::chrono::floor<std::chrono::seconds>(local).count();
+			long long days = secs >= 0 ? secs / 86400 : (secs - 86399) / 86400;
+			long long sod = secs - days * 86400;
+
+			// consecutive queries mostly fall on the same day
+			thread_local long long last_days = std::numeric_limits<long long>::min();
+			thread_local date_time last;
+			if (days != last_days) {
+				civil_from_days(days, last.year, last.month, last.day);
+				last.yday = (int)(days - days_from_civil(last.year, 1, 1)) + 1;
+				last.wday = (int)((days % 7 + 11) % 7);
+				last_days = days;
+			}
+
+			date_time dt = last;
+			dt.hour = (int)(sod / 3600);
+			dt.minute = (int)(sod / 60 % 60);
+			dt.second = (double)(sod % 60) + std::chrono::duration<double>(local - std::chrono::seconds(secs)).count();
+			return dt;
+		}
+
+		std::chrono::system_clock::time_point from_civil(int year, int mon, int day, int hour = 0, int minute = 0, double sec = 0) const {
+			auto local = std::chrono::seconds(days_from_civil(year, mon, day) * 86400 + hour * 3600 + minute * 60)
+				+ std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::duration<double>(sec));
+			return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(local) - offset);
+		}
+	};
+
+
+
 	class reference_frame : public wsn_type {
 	protected:
 		Eigen::Matrix3d mat, invmat;
 		vector3 org, orglla;
-		double timezone;
+		double timezone = 0.;
+		uint version = 1;	// changes with the frame, for the coordinates cached from it
 
 	public:
 		reference_frame() {
@@ -199,6 +281,10 @@ namespace wsn {
 			return timezone;
 		}
 
+		calendar get_calendar() const {
+			return calendar(timezone);
+		}
+
 		void set_frame(double org_lat, double org_lon, double org_alt,
 			double ext1_lat, double ext1_lon, double ext1_alt,
 			double ext2_lat, double ext2_lon, double ext2_alt);
@@ -215,11 +301,16 @@ namespace wsn {
 			alt = orglla[2];
 		}
 
+		uint get_version() const {
+			return version;
+		}
+
 		vector3 zenith_dir() const;
 		vector3 north_dir() const;
 
 		void local2global(double xl, double yl, double zl, double& xg, double& yg, double& zg) const;
 		void local2lla(double xl, double yl, double zl, double& lat, double& lon, double& alt) const;
+		void local2lla(const Eigen::Matrix3Xd& local, Eigen::Matrix3Xd& lla) const;	// one point per column, lat lon alt
 		void global2local(double xg, double yg, double zg, double& xl, double& yl, double& zl) const;
 		void lla2local(double lat, double lon, double alt, double& xl, double& yl, double& zl) const;
 
@@ -339,31 +430,778 @@ namespace wsn {
 		}
 
 
-		static std::chrono::system_clock::time_point mktime(int year, int mon, int day, int hour = 0, int minute = 0, int sec = 0) {
-			tm tinf = {};
-			tinf.tm_year = year - 1900;
-			tinf.tm_mon = mon - 1;
-			tinf.tm_mday = day;
-			tinf.tm_hour = hour;
-			tinf.tm_min = minute;
-			tinf.tm_sec = sec;
-			return std::chrono::system_clock::from_time_t(::mktime(&tinf));
+		// civil time in a timezone, in hours ahead of UTC: usually the reference frame's
+		static std::chrono::system_clock::time_point mktime(int year, int mon, int day, int hour = 0, int minute = 0, int sec = 0, double timezone = 0.) {
+			return calendar(timezone).from_civil(year, mon, day, hour, minute, sec);
+		}
+	};
+
+
+
+	// runs the work posted for a world at given times, from one dispatcher thread. its time is the
+	// simulated time since the first start: it stands still while stopped, unlike the clock's which
+	// counts from 0 again after each start.
+	// periodic work with the same period and phase shares one wake-up per period.
+	class scheduler {
+	protected:
+		struct task {
+			double due;
+			uint64_t seq;
+			std::function<void()> run;
+
+			bool operator>(const task& other) const {
+				return due > other.due || (due == other.due && seq > other.seq);
+			}
+		};
+
+		struct periodic_group {
+			struct member {
+				double first_due;
+				std::function<bool()> run;
+			};
+
+			std::pair<long long, long long> key;	// period and phase, in units of the resolution
+			double period;
+			double due;
+			std::vector<member> members;
+			std::mutex mutex;
+		};
+
+		const clock& ref_clock;
+		std::vector<task> queue;		// min heap on (due, seq)
+		uint64_t next_seq = 0;
+		double base = 0;				// scheduler time at the last start of the clock
+		double paused_at = 0;			// scheduler time at the last stop
+		std::atomic<bool> running = false;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::thread dispatcher;
+
+		double resolution = 1e-3;		// seconds, periodic work closer in phase than this is grouped
+		std::map<std::pair<long long, long long>, std::shared_ptr<periodic_group>> groups;
+		std::mutex groups_mutex;
+
+		void dispatch() {
+			std::unique_lock lock(mutex);
+
+			while (running) {
+				if (queue.empty()) {
+					cond.wait(lock);
+					continue;
+				}
+
+				auto due = queue.front().due - base;
+				if (ref_clock.clock_now() < due) {
+					cond.wait_until(lock, ref_clock.clock2system(due));
+					continue;
+				}
+
+				std::pop_heap(queue.begin(), queue.end(), std::greater<>());
+				auto t = std::move(queue.back());
+				queue.pop_back();
+
+				lock.unlock();
+				t.run();
+				lock.lock();
+			}
+		}
+
+		void run_group(const std::shared_ptr<periodic_group>& g) {
+			double next;
+			{
+				std::lock_guard lock(g->mutex);
+
+				auto t = g->due + resolution;
+				auto itr = std::remove_if(g->members.begin(), g->members.end(), [t](auto& m) {
+					// members that joined after this tick was armed wait for the next one
+					return m.first_due <= t && !m.run();
+				});
+				g->members.erase(itr, g->members.end());
+
+				next = g->due += g->period;
+			}
+
+			{
+				std::lock_guard lock(groups_mutex);
+				std::lock_guard lock2(g->mutex);
+				if (g->members.empty()) {
+					groups.erase(g->key);
+					return;
+				}
+			}
+
+			post_at(next, [this, g]() { run_group(g); });
+		}
+
+	public:
+		explicit scheduler(const clock& _ref_clock)
+			: ref_clock(_ref_clock)
+		{}
+
+		~scheduler() {
+			stop();
+		}
+
+		double now() const {
+			return running ? base + ref_clock.clock_now() : paused_at;
+		}
+
+		void post_at(double t, std::function<void()> f) {
+			{
+				std::lock_guard lock(mutex);
+				queue.push_back({ t, next_seq++, std::move(f) });
+				std::push_heap(queue.begin(), queue.end(), std::greater<>());
+			}
+			cond.notify_one();
+		}
+
+		void post_after(double dt, std::function<void()> f) {
+			post_at(now() + dt, std::move(f));
+		}
+
+		template <typename _Rep, typename _Period>
+		void post_after(std::chrono::duration<_Rep, _Period> dur, std::function<void()> f) {
+			post_after(std::chrono::duration<double>(dur).count(), std::move(f));
+		}
+
+		void post(std::function<void()> f) {
+			post_after(0., std::move(f));
+		}
+
+		// runs f at first_due and then every period for as long as it returns true. f runs on the
+		// dispatcher along with the rest of its group, so it should only hand the work over (to a mailbox)
+		void post_periodic(double first_due, double period, std::function<bool()> f) {
+			auto p = std::max(1LL, std::llround(period / resolution));
+			std::pair<long long, long long> key(p, std::llround(std::fmod(first_due, period) / resolution) % p);
+
+			std::shared_ptr<periodic_group> g;
+			bool created = false;
+			{
+				std::lock_guard lock(groups_mutex);
+
+				auto& slot = groups[key];
+				if (!slot) {
+					slot = std::make_shared<periodic_group>();
+					slot->key = key;
+					slot->period = period;
+					slot->due = first_due;
+					created = true;
+				}
+				g = slot;
+
+				std::lock_guard lock2(g->mutex);
+				g->members.push_back({ first_due, std::move(f) });
+			}
+
+			if (created) post_at(first_due, [this, g]() { run_group(g); });
+		}
+
+		void set_resolution(double r) {
+			resolution = r;
+		}
+
+		double get_resolution() const {
+			return resolution;
+		}
+
+		size_t pending() {
+			std::lock_guard lock(mutex);
+			return queue.size();
+		}
+
+		size_t periodic_group_count() {
+			std::lock_guard lock(groups_mutex);
+			return groups.size();
+		}
+
+		// the clock must be started first
+		void start() {
+			std::lock_guard lock(mutex);
+			if (running) return;
+
+			base = paused_at;
+			running = true;
+			dispatcher = std::thread([this]() { dispatch(); });
+		}
+
+		// to be called before stopping the clock
+		void stop() {
+			{
+				std::lock_guard lock(mutex);
+				if (!running) return;
+
+				paused_at = base + ref_clock.clock_now();
+				running = false;
+			}
+			cond.notify_one();
+
+			if (dispatcher.get_id() == std::this_thread::get_id())
+				dispatcher.detach();
+			else
+				dispatcher.join();
+		}
+	};
+
+
+
+
+
+	// the work posted to an actor (a node, the network, an ambient or the world), run one item at a
+	// time: handlers of an actor never run concurrently, so its components need no locks of their own
+	class mailbox {
+	protected:
+		entity* owner;
+		std::mutex mutex;
+		std::vector<std::function<void()>> queue, running;
+		bool scheduled = false;
+
+	public:
+		explicit mailbox(entity* _owner)
+			: owner(_owner)
+		{}
+
+		entity& get_owner() const {
+			return *owner;
+		}
+
+		// true when the mailbox was idle and has to be handed to an executor
+		bool push(std::function<void()> f) {
+			std::lock_guard lock(mutex);
+			queue.push_back(std::move(f));
+			if (scheduled) return false;
+
+			scheduled = true;
+			return true;
+		}
+
+		// runs what was posted so far, true when more arrived meanwhile and the mailbox stays scheduled
+		bool run() {
+			{
+				std::lock_guard lock(mutex);
+				std::swap(queue, running);
+			}
+
+			for (auto& f : running) f();
+			running.clear();
+
+			std::lock_guard lock(mutex);
+			if (!queue.empty()) return true;
+
+			scheduled = false;
+			return false;
+		}
+	};
+
+
+	// runs scheduled mailboxes on a pool of workers. each worker takes the last mailbox it queued
+	// itself first, and steals the oldest ones of the other workers when it runs out.
+	// the worlds of a process share one pool (get_shared), running while any of them is started
+	class executor {
+	protected:
+		struct job {
+			mailbox* box;
+			std::shared_ptr<entity> keep;	// the mailbox's owner stays alive while queued
+		};
+
+		struct worker {
+			std::mutex mutex;
+			std::deque<job> jobs;
+		};
+
+		std::vector<std::unique_ptr<worker>> workers;
+		std::vector<std::thread> threads;
+		std::atomic<uint> next_worker = 0;
+		std::mutex idle_mutex;
+		std::condition_variable idle;
+		size_t queued = 0;	// jobs not yet claimed by a worker
+		uint users = 0;
+		bool running = false;
+
+		static inline thread_local executor* local_executor = nullptr;
+		static inline thread_local uint local_worker = 0;
+
+		bool take(uint self, job& j) {
+			{
+				auto& w = *workers[self];
+				std::lock_guard lock(w.mutex);
+				if (!w.jobs.empty()) {
+					j = std::move(w.jobs.back());
+					w.jobs.pop_back();
+					return true;
+				}
+			}
+
+			for (uint i = 1; i < workers.size(); i++) {
+				auto& w = *workers[(self + i) % workers.size()];
+				std::lock_guard lock(w.mutex);
+				if (!w.jobs.empty()) {
+					j = std::move(w.jobs.front());
+					w.jobs.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void work(uint self) {
+			local_executor = this;
+			local_worker = self;
+
+			while (true) {
+				{
+					std::unique_lock lock(idle_mutex);
+					idle.wait(lock, [this]() { return !running || queued > 0; });
+					if (!running) break;
+					queued--;
+				}
+
+				// the claimed job is queued by now, only a concurrent take can make it move
+				job j;
+				while (!take(self, j)) std::this_thread::yield();
+
+				if (j.box->run()) submit(j.box, std::move(j.keep));
+			}
+
+			local_executor = nullptr;
+		}
+
+	public:
+		explicit executor(uint worker_count = std::max(1u, std::thread::hardware_concurrency())) {
+			for (uint i = 0; i < worker_count; i++)
+				workers.emplace_back(std::make_unique<worker>());
+		}
+
+		~executor() {
+			shutdown();
+		}
+
+		static std::shared_ptr<executor> get_shared() {
+			static std::mutex mutex;
+			static std::weak_ptr<executor> shared;
+
+			std::lock_guard lock(mutex);
+			auto sp = shared.lock();
+			if (!sp) {
+				sp = std::make_shared<executor>();
+				shared = sp;
+			}
+			return sp;
+		}
+
+		uint get_worker_count() const {
+			return (uint)workers.size();
+		}
+
+		void submit(mailbox* box, std::shared_ptr<entity> keep) {
+			uint w = local_executor == this ? local_worker : next_worker++ % workers.size();
+			{
+				std::lock_guard lock(workers[w]->mutex);
+				workers[w]->jobs.push_back({ box, std::move(keep) });
+			}
+			{
+				std::lock_guard lock(idle_mutex);
+				queued++;
+			}
+			idle.notify_one();
+		}
+
+		// counted: the workers run from the first start to the last stop
+		void start() {
+			std::lock_guard lock(idle_mutex);
+			if (users++ > 0) return;
+
+			running = true;
+			for (uint i = 0; i < workers.size(); i++)
+				threads.emplace_back([this, i]() { work(i); });
+		}
+
+		// mailboxes still queued are kept for the next start
+		void stop() {
+			{
+				std::lock_guard lock(idle_mutex);
+				if (users == 0 || --users > 0) return;
+			}
+			shutdown();
+		}
+
+	protected:
+		void shutdown() {
+			{
+				std::lock_guard lock(idle_mutex);
+				users = 0;
+				if (!running) return;
+				running = false;
+			}
+			idle.notify_all();
+
+			for (auto& t : threads) {
+				if (t.get_id() == std::this_thread::get_id())
+					t.detach();
+				else
+					t.join();
+			}
+			threads.clear();
+		}
+	};
+
+
+
+
+
+	// memory of a world: entities, event subscriptions, timers and the rest come from a pool on top
+	// of a monotonic buffer, so what dead entities free is reused by the next ones instead of piling
+	// up while nodes come and go. everything is released at once when the world and the last of its
+	// entities are gone
+	class world_arena {
+	protected:
+		// keeps the buffers of dead arenas for the next ones, so that a new world
+		// reuses memory that is already mapped instead of faulting in fresh pages
+		class block_cache : public std::pmr::memory_resource {
+		protected:
+			std::mutex mutex;
+			std::multimap<size_t, void*> blocks;	// size -> block, alignment is always max_align_t
+			size_t cached_size = 0;
+
+			static constexpr size_t max_cached_size = size_t(256) << 20;
+
+			void* do_allocate(size_t bytes, size_t) override {
+				{
+					std::lock_guard lock(mutex);
+					auto itr = blocks.find(bytes);
+					if (itr != blocks.end()) {
+						auto p = itr->second;
+						blocks.erase(itr);
+						cached_size -= bytes;
+						return p;
+					}
+				}
+
+				return std::pmr::new_delete_resource()->allocate(bytes, alignof(std::max_align_t));
+			}
+
+			void do_deallocate(void* p, size_t bytes, size_t) override {
+				{
+					std::lock_guard lock(mutex);
+					if (cached_size + bytes <= max_cached_size) {
+						blocks.emplace(bytes, p);
+						cached_size += bytes;
+						return;
+					}
+				}
+
+				std::pmr::new_delete_resource()->deallocate(p, bytes, alignof(std::max_align_t));
+			}
+
+			bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+				return this == &other;
+			}
+
+		public:
+			~block_cache() {
+				for (auto& b : blocks) {
+					std::pmr::new_delete_resource()->deallocate(b.second, b.first, alignof(std::max_align_t));
+				}
+			}
+		};
+
+		static block_cache& get_block_cache() {
+			static block_cache cache;
+			return cache;
+		}
+
+		class synchronized_monotonic : public std::pmr::memory_resource {
+		protected:
+			std::mutex mutex;
+			std::pmr::monotonic_buffer_resource buffer;
+
+			void* do_allocate(size_t bytes, size_t alignment) override {
+				std::lock_guard lock(mutex);
+				return buffer.allocate(bytes, alignment);
+			}
+
+			void do_deallocate(void*, size_t, size_t) override {
+				// released with the buffer
+			}
+
+			bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+				return this == &other;
+			}
+
+		public:
+			synchronized_monotonic(size_t initial_size)
+				: buffer(initial_size, &get_block_cache())
+			{
+			}
+		};
+
+		synchronized_monotonic monotonic;
+
+		// blocks above the largest pool size would go to the buffer and never come back
+		std::pmr::synchronized_pool_resource pool{ std::pmr::pool_options{ 0, 1 << 16 }, &monotonic };
+
+		static inline thread_local std::shared_ptr<world_arena> current;
+
+	public:
+		world_arena(size_t initial_size = 1 << 20)
+			: monotonic(initial_size)
+		{
+		}
+
+		std::pmr::memory_resource* get_monotonic_resource() {
+			return &monotonic;
+		}
+
+		std::pmr::memory_resource* get_pool_resource() {
+			return &pool;
+		}
+
+		static std::shared_ptr<world_arena> get_current() {
+			return current;
+		}
+
+		// entities created on this thread while a scope is alive take their memory from its arena
+		class scope {
+		protected:
+			std::shared_ptr<world_arena> previous;
+
+		public:
+			scope(std::shared_ptr<world_arena> arena)
+				: previous(current)
+			{
+				current = arena;
+			}
+
+			~scope() {
+				current = previous;
+			}
+		};
+	};
+
+
+	// allocates from an arena and keeps it alive until the allocation is given back,
+	// which makes it fit for the control blocks of shared_ptr
+	template <typename type>
+	class arena_allocator {
+	public:
+		using value_type = type;
+
+		std::shared_ptr<world_arena> arena;
+		bool pooled;
+
+		arena_allocator(std::shared_ptr<world_arena> _arena, bool _pooled = false)
+			: arena(_arena), pooled(_pooled)
+		{
+		}
+
+		template <typename other_type>
+		arena_allocator(const arena_allocator<other_type>& other)
+			: arena(other.arena), pooled(other.pooled)
+		{
+		}
+
+		std::pmr::memory_resource* resource() const {
+			if (!arena) return std::pmr::new_delete_resource();
+			return pooled ? arena->get_pool_resource() : arena->get_monotonic_resource();
+		}
+
+		type* allocate(size_t n) {
+			return static_cast<type*>(resource()->allocate(n * sizeof(type), alignof(type)));
+		}
+
+		void deallocate(type* p, size_t n) {
+			resource()->deallocate(p, n * sizeof(type), alignof(type));
+		}
+
+		template <typename other_type>
+		bool operator ==(const arena_allocator<other_type>& other) const {
+			return arena == other.arena && pooled == other.pooled;
+		}
+
+		template <typename other_type>
+		bool operator !=(const arena_allocator<other_type>& other) const {
+			return !(*this == other);
 		}
 	};
 
 
+	// storage placing entities of some types side by side (see archetype.h), used by make_entity while a scope is alive
+	class entity_storage {
+	protected:
+		static inline thread_local entity_storage* current = nullptr;
+
+	public:
+		struct slot {
+			void* memory = nullptr;
+			bool* live = nullptr;			// true while an entity is constructed in memory
+			std::shared_mutex* churn = nullptr;	// held to flip live, kept allocated by owner
+			std::shared_ptr<void> owner;	// keeps memory allocated
+		};
+
+		virtual ~entity_storage() {
+		}
+
+		// false if entities of that type are not stored here
+		virtual bool allocate(const std::type_info& type, slot& result) = 0;
+
+		static entity_storage* get_current() {
+			return current;
+		}
+
+		class scope {
+		protected:
+			entity_storage* previous;
+
+		public:
+			scope(entity_storage* storage)
+				: previous(current)
+			{
+				current = storage;
+			}
+
+			~scope() {
+				current = previous;
+			}
+		};
+	};
+
+
+	// creates an entity in the current storage or arena, if any
+	template <typename type, typename... Args>
+	std::shared_ptr<type> make_entity(Args&&... args) {
+		auto arena = world_arena::get_current();
+
+		entity_storage::slot slot;
+		auto storage = entity_storage::get_current();
+		if (storage && storage->allocate(typeid(type), slot)) {
+			auto p = new (slot.memory) type(std::forward<Args>(args)...);
+			{
+				std::unique_lock lock(*slot.churn);
+				*slot.live = true;
+			}
+
+			return std::shared_ptr<type>(p, [owner = slot.owner, live = slot.live, churn = slot.churn](type* p) {
+				{
+					std::unique_lock lock(*churn);
+					*live = false;
+				}
+				p->~type();
+			}, arena_allocator<type>(arena, true));
+		}
+
+		if (!arena) return std::make_shared<type>(std::forward<Args>(args)...);
+		return std::allocate_shared<type>(arena_allocator<type>(arena, true), std::forward<Args>(args)...);
+	}
+
+
+
+	// every entity holds a slot while it is alive, whose generation changes when it dies,
+	// so that handles to dead entities resolve to nullptr instead of dangling
+	class entity_registry {
+	protected:
+		struct slot {
+			std::atomic<entity*> ptr{ nullptr };
+			std::atomic<uint> generation{ 1 };
+		};
 
+		static constexpr uint chunk_bits = 12;
+		static constexpr uint chunk_size = 1 << chunk_bits;
+		static constexpr uint max_chunks = 1 << 14;
+		static constexpr uint pin_stripes = 64;
+
+		// chunks never move, so slots are read without locking. they are freed once no entity is left,
+		// and the next ones start above every generation handed out so far
+		static inline std::atomic<slot*> chunks[max_chunks];
+		static inline std::vector<std::unique_ptr<slot[]>> chunk_storage;
+		static inline std::vector<uint> free_slots;
+		static inline uint slot_count = 0, live_count = 0;
+		static inline uint first_generation = 1;
+		static inline std::mutex mutex;
+
+		// held by lock() from resolving a slot to owning its entity, and by release(), so that
+		// an entity found alive cannot be freed before its refcount is checked
+		static inline std::mutex pin_mutexes[pin_stripes];
+
+		static std::mutex& pin_mutex(uint index) {
+			return pin_mutexes[index % pin_stripes];
+		}
+
+		static void reclaim();
+
+	public:
+		static void acquire(entity* e, uint& index, uint& generation);
+		static void release(uint index);
+
+		static entity* resolve(uint index, uint generation) {
+			auto chunk = chunks[index >> chunk_bits].load(std::memory_order_acquire);
+			if (!chunk) return nullptr;
+
+			auto& sl = chunk[index & (chunk_size - 1)];
+			if (sl.generation.load(std::memory_order_acquire) != generation) return nullptr;
+			return sl.ptr.load(std::memory_order_acquire);
+		}
+
+		static std::shared_ptr<entity> lock(uint index, uint generation);
+	};
+
+
+	// non-owning reference between entities of a simulation, no refcounting.
+	// get() is only safe while something else keeps the entity alive, e.g. a component its node,
+	// or a handler the entity whose mailbox it runs on. other threads use lock()
+	template <typename type>
+	class handle {
+	protected:
+		uint index = 0;
+		uint generation = 0;	// 0: null handle
+
+	public:
+		handle() {
+		}
+
+		handle(type* p) {
+			if (p) {
+				index = p->slot_index;
+				generation = p->slot_generation;
+			}
+		}
+
+		template <typename other_type>
+		handle(const std::shared_ptr<other_type>& p)
+			: handle(static_cast<type*>(p.get()))
+		{
+		}
+
+		type* get() const {
+			if (generation == 0) return nullptr;
+			return static_cast<type*>(entity_registry::resolve(index, generation));
+		}
+
+		std::shared_ptr<type> lock() const {
+			if (generation == 0) return nullptr;
+			return std::static_pointer_cast<type>(entity_registry::lock(index, generation));
+		}
+
+		type* operator ->() const {
+			return get();
+		}
+
+		explicit operator bool() const {
+			return get() != nullptr;
+		}
+	};
 
 
 	class event {
 	public:
 		uint event_id;
-		std::shared_ptr<entity> target;
+		entity* target = nullptr;
 		bool canceled = false;
 
 		void cancel_bubble() {
 			canceled = true;
 		}
+
+		template <typename type = entity>
+		std::shared_ptr<type> get_target() const;
 	};
 
 
@@ -395,6 +1233,7 @@ namespace wsn {
 		struct event_info {
 			uint key;
 			void* function;
+			void (*destroy)(void* function, std::pmr::memory_resource* memory);
 			bool self_only;
 			const std::type_info* signature;
 		};
@@ -409,19 +1248,28 @@ namespace wsn {
 			uint key;
 			bool sync_start_stop;
 			status_type status;
+			std::atomic<uint> generation = 0;	// a tick armed for an older generation is dropped
+			double period;
+			bool periodic;		// ticks share the wake-ups of the scheduler's periodic groups
+			std::function<bool(event&)> callback;
 			std::mutex mutex;
-			std::condition_variable cond;
 		};
 
+		std::shared_ptr<world_arena> arena = world_arena::get_current();	// released last, after the containers using it
+		std::pmr::memory_resource* memory = arena ? arena->get_pool_resource() : std::pmr::get_default_resource();
+
 		uint id = unique_id();
-		std::weak_ptr<entity> parent;
-		std::multimap<uint, event_info> event_map;
-		std::list<std::shared_ptr<timer_info>> timer_list;
+		uint slot_index, slot_generation;
+		handle<entity> parent;
+		std::pmr::multimap<uint, event_info> event_map{ memory };
+		std::pmr::list<std::shared_ptr<timer_info>> timer_list{ memory };
 		std::mutex event_map_mutex, timer_list_mutex;
 		double start_time;
-		bool started = false;
+		std::atomic<bool> started = false;	// read by timer ticks on the executor
 		bool first_start = true;
 
+		template <typename type> friend class handle;
+
 	public:
 		static inline uint event_timer = unique_id();
 		static inline uint event_init = unique_id();
@@ -430,11 +1278,16 @@ namespace wsn {
 		static inline uint event_start = unique_id();
 		static inline uint event_stop = unique_id();
 
+		entity() {
+			entity_registry::acquire(this, slot_index, slot_generation);
+		}
+
 		~entity() override {
 			if (is_started()) stop();
+			entity_registry::release(slot_index);
 
-			for (auto e : event_map) {
-				delete static_cast<std::function<void()>*>(e.second.function);
+			for (auto& e : event_map) {
+				e.second.destroy(e.second.function, memory);
 			}
 		}
 
@@ -450,9 +1303,16 @@ namespace wsn {
 			return id == other->id;
 		}
 
+		handle<entity> get_handle() {
+			return handle<entity>(this);
+		}
+
 		virtual std::shared_ptr<basic_world> get_world() = 0;
 		virtual std::shared_ptr<const basic_world> get_world() const = 0;
 
+		// no locking nor refcounting, for the simulation's own use
+		virtual basic_world* get_world_ptr() const = 0;
+
 		double get_local_clock_time() const;
 		double get_world_clock_time() const;
 		std::chrono::system_clock::time_point get_reference_time() const;
@@ -463,7 +1323,7 @@ namespace wsn {
 		}
 
 		void set_parent_for(std::shared_ptr<entity> child) {
-			child->set_parent(std::dynamic_pointer_cast<entity>(shared_from_this()));
+			child->parent = this;
 		}
 
 		std::shared_ptr<entity> get_parent() const {
@@ -471,74 +1331,16 @@ namespace wsn {
 			return sp;
 		}
 
-		// sync_start_stop: the start/stop events will be taken into account in the management of the timer or not
+	protected:
+		uint add_timer(double period, bool periodic, bool sync_start_stop, std::function<bool(event&)> callback);
+
+	public:
+		// sync_start_stop: the start/stop events will be taken into account in the management of the timer or not.
+		// ticks come from the world's scheduler and run on the mailbox of this entity's actor; timers of
+		// the same period started at the same time wake up together
 		template <typename _Rep, typename _Period>
 		uint timer(std::chrono::duration<_Rep, _Period> dur, bool sync_start_stop, std::function<bool(event&)> callback) {
-			auto inf = std::make_shared<timer_info>();
-			inf->key = unique_id();
-			inf->sync_start_stop = sync_start_stop;
-
-			{
-				std::lock_guard lock(timer_list_mutex);
-				timer_list.push_back(inf);
-			}
-
-			if (sync_start_stop) {
-				inf->status = started ? status_type::running : status_type::paused;
-
-				on_self(event_start, [inf](event&) {
-					inf->status = status_type::running;
-					inf->cond.notify_one();
-				});
-
-				on_self(event_stop, [inf](event&) {
-					inf->status = status_type::paused;
-					inf->cond.notify_one();
-				});
-			}
-			else {
-				inf->status = status_type::running;
-			}
-
-			try {
-				std::thread([inf, dur, sync_start_stop, callback, this]() {
-					do {
-						if (inf->status == status_type::paused) {
-							std::unique_lock lock(inf->mutex);
-							inf->cond.wait(lock, [inf]() { return inf->status != status_type::paused; });
-						}
-
-						while (inf->status == status_type::running) {
-							auto rdur = dur / (get_world()->get_clock().get_scale());
-
-							std::unique_lock lock(inf->mutex);
-							if (inf->cond.wait_for(lock, rdur, [inf]() { return inf->status != status_type::running; })) break;
-
-							event ev;
-							ev.event_id = event_timer;
-							ev.target = std::dynamic_pointer_cast<entity>(shared_from_this());
-							if (!callback(ev)) {
-								inf->status = status_type::stopped;
-								break;
-							}
-						}
-					} while (inf->status != status_type::stopped);
-
-					{
-						std::lock_guard lock(timer_list_mutex);
-
-						auto itr = std::find_if(timer_list.begin(), timer_list.end(), [inf](auto inf2) {
-							return inf2->key == inf->key;
-						});
-
-						if (itr != timer_list.end()) timer_list.erase(itr);
-					}
-				}).detach();
-			}
-			catch (...) {
-			}
-
-			return inf->key;
+			return add_timer(std::chrono::duration<double>(dur).count(), true, sync_start_stop, std::move(callback));
 		}
 
 		template <typename _Rep, typename _Period>
@@ -551,32 +1353,63 @@ namespace wsn {
 
 		template <typename _Rep, typename _Period>
 		uint timer_once(std::chrono::duration<_Rep, _Period> dur, bool sync_start_stop, std::function<void(event&)> callback) {
-			return timer(dur, sync_start_stop, (std::function<bool(event&)>)[callback](event& ev) -> bool {
+			return add_timer(std::chrono::duration<double>(dur).count(), false, sync_start_stop, [callback](event& ev) -> bool {
 				callback(ev);
 				return false;
 			});
 		}
 
 		void stop_timer(uint key) {
-			auto itr = std::find_if(timer_list.begin(), timer_list.end(), [key](auto inf) {
+			std::lock_guard lock(timer_list_mutex);
+
+			auto itr = std::find_if(timer_list.begin(), timer_list.end(), [key](auto& inf) {
 				return key == inf->key;
 			});
 
 			if (itr == timer_list.end()) return;
 
-			auto inf = *itr;
-			std::unique_lock lock(inf->mutex);
-			inf->status = status_type::stopped;
-			inf->cond.notify_one();
+			{
+				auto& inf = *itr;
+				std::lock_guard lock(inf->mutex);
+				inf->status = status_type::stopped;
+				inf->generation++;
+			}
+			timer_list.erase(itr);
 		}
 
+		// the mailbox running the handlers of this entity
+		virtual mailbox& get_mailbox() = 0;
+
+		// runs f on this entity's mailbox, after the work already posted there
+		void post(std::function<void()> f);
+
+	protected:
+		// with inf->mutex held
+		void arm_timer(const std::shared_ptr<timer_info>& inf, double due);
+		void run_timer(const std::shared_ptr<timer_info>& inf, uint generation);
+
+	protected:
+		template <typename Function>
+		void* new_function(Function& lambda, void (*&destroy)(void*, std::pmr::memory_resource*)) {
+			using function_type = decltype(to_function(lambda));
+
+			auto p = memory->allocate(sizeof(function_type), alignof(function_type));
+			new (p) function_type(to_function(lambda));
+
+			destroy = [](void* f, std::pmr::memory_resource* mem) {
+				static_cast<function_type*>(f)->~function_type();
+				mem->deallocate(f, sizeof(function_type), alignof(function_type));
+			};
+			return p;
+		}
+
+	public:
 		template <typename Function>
 		uint on(uint event_id, Function lambda) {
-			auto function = new decltype(to_function(lambda))(to_function(lambda));
 			event_info cb;
 			cb.key = unique_id();
-			cb.function = static_cast<void*>(function);
-			cb.signature = &typeid(function);
+			cb.function = new_function(lambda, cb.destroy);
+			cb.signature = &typeid(decltype(to_function(lambda))*);
 			cb.self_only = false;
 
 			{
@@ -588,11 +1421,10 @@ namespace wsn {
 
 		template <typename Function>
 		uint on_self(uint event_id, Function lambda) {
-			auto function = new decltype(to_function(lambda))(to_function(lambda));
 			event_info cb;
 			cb.key = unique_id();
-			cb.function = static_cast<void*>(function);
-			cb.signature = &typeid(function);
+			cb.function = new_function(lambda, cb.destroy);
+			cb.signature = &typeid(decltype(to_function(lambda))*);
 			cb.self_only = true;
 
 			{
@@ -609,24 +1441,35 @@ namespace wsn {
 				return e.second.key == key;
 			});
 			
-			if (itr != event_map.end()) event_map.erase(itr);
+			if (itr != event_map.end()) {
+				itr->second.destroy(itr->second.function, memory);
+				event_map.erase(itr);
+			}
 		}
 
 		template <typename ...Args>
 		void fire(uint event_id, Args... args) {
 			event ev;
 			ev.event_id = event_id;
-			ev.target = std::dynamic_pointer_cast<entity>(shared_from_this());
+			ev.target = this;
 			fire(ev, args...);
 		}
 
 	protected:
+		// handlers of an actor that shares nothing with the event's target, typically the network, run on
+		// the target's worker: they take turns on the world's dispatch lock
+		std::unique_lock<std::recursive_mutex> lock_dispatch(entity& target);
+
 		template <typename ...Args>
 		void fire(event& ev, Args... args) {
 			auto range = event_map.equal_range(ev.event_id);
+
+			std::unique_lock<std::recursive_mutex> lock;
+			if (range.first != range.second && ev.target != this) lock = lock_dispatch(*ev.target);
+
 			for (auto itr = range.first; itr != range.second; itr++) {
 				auto cb = itr->second;
-				if (cb.self_only && !is_same(ev.target)) continue;
+				if (cb.self_only && !is_same(*ev.target)) continue;
 
 				auto function = static_cast<std::function<void(event&, Args...)>*>(cb.function);
 
@@ -637,8 +1480,8 @@ namespace wsn {
 			}
 
 			if (!ev.canceled) {
-				auto parentsp = parent.lock();
-				if (parentsp) parentsp->fire(ev, args...);
+				auto p = parent.get();
+				if (p) p->fire(ev, args...);
 			}
 		}
 
@@ -652,13 +1495,7 @@ namespace wsn {
 		}
 
 		virtual void start();
-
-		virtual void stop() {
-			if (!started) return;
-
-			started = false;
-			fire(event_stop);
-		}
+		virtual void stop();
 
 		bool is_started() const {
 			return started;
@@ -666,13 +1503,20 @@ namespace wsn {
 	};
 
 
+	template <typename type>
+	std::shared_ptr<type> event::get_target() const {
+		if (!target) return nullptr;
+		return std::dynamic_pointer_cast<type>(target->weak_from_this().lock());
+	}
+
+
 
 
 
 	// base class for comm, power, sensor, battery, controller
 	class node_component : public entity {
 	protected:
-		std::weak_ptr<basic_node> node;
+		handle<basic_node> node;
 
 	public:
 		void set_node(std::shared_ptr<basic_node> _node) {
@@ -693,9 +1537,25 @@ namespace wsn {
 			return sp2;
 		}
 
+		// no locking nor refcounting, for per-tick code
+		basic_node& get_node_ref() const {
+			auto p = node.get();
+			assert(p);
+			return *p;
+		}
+
+		template <typename node_type>
+		node_type& get_node_ref() const {
+			return static_cast<node_type&>(get_node_ref());
+		}
+
 		std::shared_ptr<basic_network> get_network() const;
 		std::shared_ptr<basic_world> get_world() override;
 		std::shared_ptr<const basic_world> get_world() const override;
+		basic_world* get_world_ptr() const override;
+
+		// components share the mailbox of their node
+		mailbox& get_mailbox() override;
 
 		friend class basic_node;
 		friend class basic_network;
@@ -707,34 +1567,57 @@ namespace wsn {
 
 
 	class basic_comm : public node_component {
+	public:
+		using node_list = std::vector<std::shared_ptr<basic_node>>;
+
+		// frame layout: the headers of the wrapped layers, innermost first, then the payload.
+		// each layer with a header defines its own offsets from the ones of the layer it wraps.
+		static constexpr uint header_offset = 0;		// where the header of a layer starts in a frame
+		static constexpr uint frame_header_size = 0;	// size of the headers of a layer and all layers below it
+
 	protected:
 
 		static auto make_shared_data(const std::vector<uchar>& data) {
 			return std::make_shared<std::vector<uchar>>(data);
 		}
 
-		template <typename info_type>
-		static void add_header(std::vector<uchar>& data, const info_type& info) {
-			data.insert(data.begin(), (const uchar*)&info, (const uchar*)&info + sizeof(info));
+		// allocates a frame once, with room for headers_size bytes of headers followed by the payload
+		static std::vector<uchar> make_frame(uint headers_size, const uchar* payload, size_t payload_size) {
+			std::vector<uchar> frame(headers_size + payload_size);
+			if (payload_size > 0) std::memcpy(frame.data() + headers_size, payload, payload_size);
+			return frame;
 		}
 
-		static void remove_header(std::vector<uchar>& data, uint len) {
-			std::vector<uchar>(data.begin() + len, data.end()).swap(data);
+		static std::vector<uchar> make_frame(uint headers_size, const std::vector<uchar>& payload) {
+			return make_frame(headers_size, payload.data(), payload.size());
 		}
 
 		template <typename info_type>
-		static void extract_header(const std::vector<uchar>& data, info_type& info) {
-			std::memcpy((uchar*)&info, data.data(), sizeof(info));
+		static void write_header(std::vector<uchar>& frame, uint offset, const info_type& info) {
+			assert(frame.size() >= offset + sizeof(info));
+			std::memcpy(frame.data() + offset, (const uchar*)&info, sizeof(info));
 		}
 
 		template <typename info_type>
-		static const info_type& extract_header(const std::vector<uchar>& data) {
-			return *(const info_type*)data.data();
+		static void read_header(const std::vector<uchar>& frame, uint offset, info_type& info) {
+			assert(frame.size() >= offset + sizeof(info));
+			std::memcpy((uchar*)&info, frame.data() + offset, sizeof(info));
 		}
 
-		template <typename info_type>
-		static info_type& extract_header(std::vector<uchar>& data) {
-			return *(info_type*)data.data();
+		// posts the same frame to the mailbox of every receiver; layers never modify received frames in place
+		void deliver(std::shared_ptr<std::vector<uchar>> frame, const node_list& receivers);
+
+		// multicasts data to the receivers, or hands each of them to sender when given
+		void send_to_receivers(const std::vector<uchar>& data, const node_list& receivers,
+			std::function<void(std::shared_ptr<basic_node>)> sender);
+
+		// link level: frames already carry the headers of all layers, transport layers (delays, none...) override these
+		virtual void send_frame(std::vector<uchar> frame, std::shared_ptr<basic_node> to);
+		virtual void multicast_frame(std::vector<uchar> frame, const node_list& receivers);
+
+		void route_frame(std::vector<uchar>, std::shared_ptr<basic_node>) {
+			// to be implemented by routing layers
+			assert(false);
 		}
 
 	public:
@@ -748,13 +1631,23 @@ namespace wsn {
 			return true;
 		}
 
-		virtual void send(const std::vector<uchar>& data, std::shared_ptr<basic_node> to);
+		virtual void send(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) {
+			send_frame(data, to);
+		}
+
+		// sends one shared copy of data to all receivers
+		virtual void multicast(const std::vector<uchar>& data, const node_list& receivers) {
+			multicast_frame(data, receivers);
+		}
 
 		virtual void broadcast(const std::vector<uchar>& data, std::function<bool(std::shared_ptr<basic_node>)> condition,
 			std::function<void(std::shared_ptr<basic_node>)> sender = nullptr);
 		void broadcast_by_distance(const std::vector<uchar>& data, double range,
 			std::function<void(std::shared_ptr<basic_node>)> sender = nullptr);
 
+		node_list find_receivers(std::function<bool(basic_node*)> condition) const;
+		node_list find_receivers_in_range(double range) const;
+
 		virtual void route(const std::vector<uchar>& data, std::shared_ptr<basic_node> to) {
 			// to be optionally implemented by derived classes
 			assert(false);
@@ -804,6 +1697,19 @@ namespace wsn {
 		static inline const uint event_empty = unique_id();
 
 
+		using harvest_profile = std::function<double(double)>;
+
+	protected:
+		uint empty_timer = 0;
+		double prediction_step = 600., prediction_horizon = 365 * 86400.;
+
+		// brings the model to empty when a prediction of expect_empty comes due, reporting what was left as
+		// consumed. false if it already was empty, in which case the model has fired event_empty itself
+		virtual bool deplete() {
+			return get_soc() > 0.;
+		}
+
+	public:
 		basic_battery() {
 		}
 
@@ -817,6 +1723,36 @@ namespace wsn {
 		virtual double get_norminal_voltage() const = 0;	// V
 		virtual double get_capacity() const = 0;			// current capacity in Ah
 		virtual double get_max_capacity() const = 0;		// max capacity in Ah
+
+		// seconds until the state of charge reaches soc, consuming a fraction load of the time and charging
+		// a fraction harvest(t) of the time t seconds from now (none if empty), as charge(T)/consume(T) would.
+		// infinity if it doesn't within the prediction horizon, nan if the model can't tell
+		virtual double predict_time_to([[maybe_unused]] double soc, [[maybe_unused]] double load = 1.,
+			[[maybe_unused]] const harvest_profile& harvest = nullptr) const {
+			return std::numeric_limits<double>::quiet_NaN();
+		}
+
+		// harvest profiles are sampled at this step
+		void set_prediction(double step, double horizon) {
+			prediction_step = step;
+			prediction_horizon = horizon;
+		}
+
+		// fires event_empty at the predicted time instead of polling the battery; calling it again when
+		// the load or the harvest changes replaces the prediction. the model is depleted first, so it holds
+		// no charge once event_empty fires, and nothing fires if it got empty on its own meanwhile
+		void expect_empty(double load = 1., const harvest_profile& harvest = nullptr) {
+			if (empty_timer) stop_timer(empty_timer);
+			empty_timer = 0;
+
+			double t = predict_time_to(0., load, harvest);
+			if (!std::isfinite(t)) return;
+
+			empty_timer = timer_once(std::chrono::duration<double>(t), true, [this](event&) {
+				empty_timer = 0;
+				if (deplete()) fire(event_empty);
+			});
+		}
 	};
 
 
@@ -846,25 +1782,45 @@ namespace wsn {
 
 	class basic_node : public entity {
 	protected:
-		std::weak_ptr<basic_network> network;
+		handle<basic_network> network;
 		std::string name;
 		location loc;
 
+		// geodetic coordinates of loc, valid while lla_frame is the version of the world's reference frame.
+		// actors on other workers may ask at the same time: both are only touched under lla_mutex
+		mutable std::mutex lla_mutex;
+		mutable double lla[3];
+		mutable uint lla_frame = 0;
+
+		// set by generic_node, same objects as its typed components
+		std::shared_ptr<basic_comm> comm_base;
+		std::shared_ptr<basic_sensor> sensor_base;
+		std::shared_ptr<basic_battery> battery_base;
+		std::shared_ptr<basic_power> power_base;
+		std::shared_ptr<basic_controller> controller_base;
+
+		mailbox box{ this };
+		uint active_index = inactive;	// position in the network's active set
+
 		friend class basic_network;
 		friend class basic_controller;
 
+		static constexpr uint inactive = uint(-1);
+
 	public:
+		static inline const uint event_move = unique_id();
+
 		basic_node(const std::string _name, const location& _loc)
 			: name(_name), loc(_loc)
 		{
 		}
 
 
-		virtual std::shared_ptr<basic_comm> get_comm() const = 0;
-		virtual std::shared_ptr<basic_battery> get_battery() const = 0;
-		virtual std::shared_ptr<basic_power> get_power() const = 0;
-		virtual std::shared_ptr<basic_sensor> get_sensor() const = 0;
-		virtual std::shared_ptr<basic_controller> get_controller() const = 0;
+		const std::shared_ptr<basic_comm>& get_comm() const { return comm_base; }
+		const std::shared_ptr<basic_battery>& get_battery() const { return battery_base; }
+		const std::shared_ptr<basic_power>& get_power() const { return power_base; }
+		const std::shared_ptr<basic_sensor>& get_sensor() const { return sensor_base; }
+		const std::shared_ptr<basic_controller>& get_controller() const { return controller_base; }
 
 		std::shared_ptr<basic_network> get_network() const {
 			auto sp = network.lock();
@@ -873,18 +1829,40 @@ namespace wsn {
 
 		std::shared_ptr<basic_world> get_world() override;
 		std::shared_ptr<const basic_world> get_world() const override;
+		basic_world* get_world_ptr() const override;
+
+		mailbox& get_mailbox() override {
+			return box;
+		}
+
+		void start() override;
+		void stop() override;
+
+		bool is_active() const {
+			return active_index != inactive;
+		}
 
 		const std::string& get_name() const { return name; }
 		void set_name(const std::string& _name) { name = _name; }
 		const location& get_location() const { return loc; }
-		void set_location(const location& _loc) { loc = _loc; }
+		void set_location(const location& _loc) {
+			{
+				std::lock_guard lock(lla_mutex);
+				loc = _loc;
+				lla_frame = 0;
+			}
+			fire(event_move);
+		}
+
+		// local2lla of the location in the world's reference frame, converted once for a static node
+		void get_lla(double& lat, double& lon, double& alt) const;
 
 		void each_component(std::function<void(std::shared_ptr<node_component>)> callback) {
-			callback(std::dynamic_pointer_cast<node_component>(get_battery()));
-			callback(std::dynamic_pointer_cast<node_component>(get_power()));
-			callback(std::dynamic_pointer_cast<node_component>(get_sensor()));
-			callback(std::dynamic_pointer_cast<node_component>(get_comm()));
-			callback(std::dynamic_pointer_cast<node_component>(get_controller()));
+			callback(battery_base);
+			callback(power_base);
+			callback(sensor_base);
+			callback(comm_base);
+			callback(controller_base);
 		}
 	};
 
@@ -907,41 +1885,32 @@ namespace wsn {
 		friend class basic_network;
 
 	public:
+		using comm_component_type = comm_type;
+		using sensor_component_type = sensor_type;
+		using battery_component_type = battery_type;
+		using power_component_type = power_type;
+		using controller_component_type = controller_type;
+
 		generic_node(const std::string _name, const location& _loc)
 			: basic_node(_name, _loc),
-			comm(std::make_shared<comm_type>()),
-			sensor(std::make_shared<sensor_type>()),
-			battery(std::make_shared<battery_type>()),
-			power(std::make_shared<power_type>()),
-			controller(std::make_shared<controller_type>())
+			comm(make_entity<comm_type>()),
+			sensor(make_entity<sensor_type>()),
+			battery(make_entity<battery_type>()),
+			power(make_entity<power_type>()),
+			controller(make_entity<controller_type>())
 		{
+			comm_base = comm;
+			sensor_base = sensor;
+			battery_base = battery;
+			power_base = power;
+			controller_base = controller;
 		}
 
-		std::shared_ptr<comm_type> get_comm_t() const { return comm; }
-		std::shared_ptr<battery_type> get_battery_t() const { return battery; }
-		std::shared_ptr<power_type> get_power_t() const { return power; }
-		std::shared_ptr<sensor_type> get_sensor_t() const { return sensor; }
-		std::shared_ptr<controller_type> get_controller_t() const { return controller; }
-
-		std::shared_ptr<basic_comm> get_comm() const override {
-			return std::dynamic_pointer_cast<basic_comm>(comm);
-		}
-
-		std::shared_ptr<basic_battery> get_battery() const override {
-			return std::dynamic_pointer_cast<basic_battery>(battery);
-		}
-
-		std::shared_ptr<basic_power> get_power() const override {
-			return std::dynamic_pointer_cast<basic_power>(power);
-		}
-
-		std::shared_ptr<basic_sensor> get_sensor() const override {
-			return std::dynamic_pointer_cast<basic_sensor>(sensor);
-		}
-
-		std::shared_ptr<basic_controller> get_controller() const override {
-			return std::dynamic_pointer_cast<basic_controller>(controller);
-		}
+		const std::shared_ptr<comm_type>& get_comm_t() const { return comm; }
+		const std::shared_ptr<battery_type>& get_battery_t() const { return battery; }
+		const std::shared_ptr<power_type>& get_power_t() const { return power; }
+		const std::shared_ptr<sensor_type>& get_sensor_t() const { return sensor; }
+		const std::shared_ptr<controller_type>& get_controller_t() const { return controller; }
 
 		void init() override {
 			basic_node::init();
@@ -976,11 +1945,41 @@ namespace wsn {
 
 	class basic_network : public entity {
 	protected:
-		std::weak_ptr<basic_world> world;
+		handle<basic_world> world;
 		std::list<std::shared_ptr<basic_node>> nodes;
+		mailbox box{ this };
+
+		// nodes not stopped on their own, compacted: a node stopping swaps the last one into its place.
+		// queries and broadcasts only look at these, so dormant nodes cost nothing
+		std::vector<basic_node*> active;
+		mutable std::shared_mutex active_mutex;
+		std::atomic<bool> pausing = false;	// nodes stopped along with the network stay in the active set
 
 		bool started = false;
 
+		void set_active(basic_node& node, bool a) {
+			std::unique_lock lock(active_mutex);
+			if (node.is_active() == a) return;
+
+			if (a) {
+				node.active_index = (uint)active.size();
+				active.push_back(&node);
+			}
+			else {
+				auto last = active.back();
+				active[node.active_index] = last;
+				last->active_index = node.active_index;
+				active.pop_back();
+				node.active_index = basic_node::inactive;
+			}
+		}
+
+		std::shared_ptr<basic_node> shared(basic_node* node) const {
+			return std::static_pointer_cast<basic_node>(node->shared_from_this());
+		}
+
+		friend class basic_node;
+
 		template <typename network_type> friend class generic_world;
 
 	public:
@@ -991,8 +1990,9 @@ namespace wsn {
 
 		template <class node_type, class... Targs>
 		std::shared_ptr<node_type> new_node(Targs... args) {
-			std::shared_ptr<node_type> node(std::make_shared<node_type>(std::forward<Targs>(args)...));
-			node->network = std::dynamic_pointer_cast<basic_network>(shared_from_this());
+			world_arena::scope scope(arena);
+			std::shared_ptr<node_type> node(make_entity<node_type>(std::forward<Targs>(args)...));
+			node->network = this;
 			node->id = unique_id();
 
 			node->each_component([node](auto c) {
@@ -1000,6 +2000,7 @@ namespace wsn {
 			});
 			set_parent_for(node);
 			nodes.push_back(node);
+			set_active(*node, true);
 
 			node->init();
 			if (started) node->start();
@@ -1027,26 +2028,57 @@ namespace wsn {
 			return nodes;
 		}
 
-		std::list<std::shared_ptr<basic_node>> find_nodes(std::function<bool(std::shared_ptr<basic_node>)> condition) const {
+		size_t get_active_node_count() const {
+			std::shared_lock lock(active_mutex);
+			return active.size();
+		}
+
+		// a copy of the active set: callbacks run on it without the lock, so they may start or stop nodes
+		std::vector<basic_node*> get_active_nodes() const {
+			std::shared_lock lock(active_mutex);
+			return active;
+		}
+
+		// in no particular order
+		void each_active_node(std::function<void(basic_node&)> callback) const {
+			for (auto n : get_active_nodes()) {
+				callback(*n);
+			}
+		}
+
+		// the queries below only consider active nodes
+
+		std::list<std::shared_ptr<basic_node>> find_nodes(std::function<bool(basic_node*)> condition) const {
 			std::list<std::shared_ptr<basic_node>> list;
-			for (auto& n : nodes) {
-				if (condition(n)) list.push_back(n);
+
+			for (auto n : get_active_nodes()) {
+				if (condition(n)) list.push_back(shared(n));
 			}
 
 			return std::move(list);
 		}
 
+		void find_nodes(std::function<bool(basic_node*)> condition, std::vector<std::shared_ptr<basic_node>>& result) const {
+			auto nodes = get_active_nodes();
+
+			result.clear();
+			result.reserve(nodes.size());
+			for (auto n : nodes) {
+				if (condition(n)) result.push_back(shared(n));
+			}
+		}
+
 		std::list<std::shared_ptr<basic_node>> find_nodes_in_range(const location& center, double range) const {
 			return find_nodes([&center, range](auto node) {
 				return node->get_location().distance_to(center) <= range;
 			});
 		}
 
-		std::shared_ptr<basic_node> find_best_node(std::function<double(std::shared_ptr<basic_node>)> evaluator) const {
-			std::shared_ptr<basic_node> node;
+		std::shared_ptr<basic_node> find_best_node(std::function<double(basic_node*)> evaluator) const {
+			basic_node* node = nullptr;
 			double v, best = std::numeric_limits<double>::min();
 
-			for (auto& n : nodes) {
+			for (auto n : get_active_nodes()) {
 				v = evaluator(n);
 				if (v > best) {
 					best = v;
@@ -1054,14 +2086,14 @@ namespace wsn {
 				}
 			}
 
-			return node;
+			return node ? shared(node) : nullptr;
 		}
 
-		std::shared_ptr<basic_node> find_worst_node(std::function<double(std::shared_ptr<basic_node>)> evaluator) const {
-			std::shared_ptr<basic_node> node;
+		std::shared_ptr<basic_node> find_worst_node(std::function<double(basic_node*)> evaluator) const {
+			basic_node* node = nullptr;
 			double v, worst = std::numeric_limits<double>::max();
 
-			for (auto& n : nodes) {
+			for (auto n : get_active_nodes()) {
 				v = evaluator(n);
 				if (v < worst) {
 					worst = v;
@@ -1069,7 +2101,7 @@ namespace wsn {
 				}
 			}
 
-			return node;
+			return node ? shared(node) : nullptr;
 		}
 
 		std::shared_ptr<basic_node> find_closest_node(const location& loc) const {
@@ -1086,6 +2118,7 @@ namespace wsn {
 			if (itr != nodes.end()) {
 				auto n = *itr;
 				if (n->is_started()) n->stop();
+				set_active(*n, false);
 				n->finalize();
 				nodes.erase(itr);
 			}
@@ -1112,6 +2145,14 @@ namespace wsn {
 			return sp;
 		}
 
+		basic_world* get_world_ptr() const override {
+			return world.get();
+		}
+
+		mailbox& get_mailbox() override {
+			return box;
+		}
+
 		void start() override;
 		void stop() override;
 	};
@@ -1124,7 +2165,8 @@ namespace wsn {
 
 	class basic_ambient : public entity {
 	protected:
-		std::weak_ptr<basic_world> world;
+		handle<basic_world> world;
+		mailbox box{ this };
 
 		template <typename network_type> friend class generic_world;
 
@@ -1132,6 +2174,7 @@ namespace wsn {
 		static inline const uint temperature = unique_id();
 		static inline const uint humidity = unique_id();
 		static inline const uint light = unique_id();
+		static inline const uint irradiance = unique_id();
 
 		std::shared_ptr<basic_world> get_world() override {
 			auto sp = world.lock();
@@ -1143,6 +2186,14 @@ namespace wsn {
 			return sp;
 		}
 
+		basic_world* get_world_ptr() const override {
+			return world.get();
+		}
+
+		mailbox& get_mailbox() override {
+			return box;
+		}
+
 		virtual void get_value(const location& loc, std::any& value) = 0;
 	};
 
@@ -1158,6 +2209,12 @@ namespace wsn {
 	protected:
 		reference_frame ref_frame;
 		clock ref_clock;
+		scheduler sched{ ref_clock };
+		std::shared_ptr<executor> exec = executor::get_shared();
+		mailbox box{ this };
+		std::recursive_mutex dispatch_mutex;
+
+		friend class entity;
 
 	public:
 		reference_frame& get_reference_frame() {
@@ -1176,6 +2233,18 @@ namespace wsn {
 			return ref_clock;
 		}
 
+		scheduler& get_scheduler() {
+			return sched;
+		}
+
+		executor& get_executor() {
+			return *exec;
+		}
+
+		mailbox& get_mailbox() override {
+			return box;
+		}
+
 		std::shared_ptr<basic_world> get_world() override {
 			return std::dynamic_pointer_cast<basic_world>(shared_from_this());
 		}
@@ -1184,13 +2253,24 @@ namespace wsn {
 			return std::dynamic_pointer_cast<const basic_world>(shared_from_this());
 		}
 
+		basic_world* get_world_ptr() const override {
+			return const_cast<basic_world*>(this);
+		}
+
 		void start() override {
+			if (is_started()) return;
+
 			ref_clock.start();
+			exec->start();
 			entity::start();
 		}
 
+		// the executor is shared: mailboxes of this world already queued still run after it stops
 		void stop() override {
+			if (!is_started()) return;
+
 			entity::stop();
+			exec->stop();
 			ref_clock.stop();
 		}
 
@@ -1208,13 +2288,15 @@ namespace wsn {
 		std::map<uint, std::shared_ptr<basic_ambient>> ambients;
 
 		generic_world()
-			: network(std::make_shared<network_type>())
+			: network(make_entity<network_type>())
 		{}
 
 	public:
-		static std::shared_ptr<generic_world<network_type>> new_world() {
+		// pass a null arena to allocate the world's entities on the global heap
+		static std::shared_ptr<generic_world<network_type>> new_world(std::shared_ptr<world_arena> arena = std::make_shared<world_arena>()) {
+			world_arena::scope scope(arena);
 			std::shared_ptr<generic_world<network_type>> w(new generic_world<network_type>());
-			w->network->world = w;
+			w->network->world = w.get();
 			w->network->set_parent(w);
 			w->init();
 			w->network->init();
@@ -1227,8 +2309,9 @@ namespace wsn {
 			// make sure only 1 ambient is created for a type
 			if (ambients.find(type) != ambients.end()) return nullptr;
 
-			std::shared_ptr<ambient_type> ambient(std::make_shared<ambient_type>(std::forward<Targs>(args)...));
-			ambient->world = std::dynamic_pointer_cast<generic_world<network_type>>(shared_from_this());
+			world_arena::scope scope(arena);
+			std::shared_ptr<ambient_type> ambient(make_entity<ambient_type>(std::forward<Targs>(args)...));
+			ambient->world = this;
 			set_parent_for(ambient);
 
 			ambients[type] = ambient;
@@ -1267,9 +2350,13 @@ namespace wsn {
 			for (auto& a : ambients) {
 				a.second->start();
 			}
+
+			// timers and behaviours wake up once everything is started
+			sched.start();
 		}
 
 		void stop() override {
+			sched.stop();
 			network->stop();
 			for (auto& a : ambients) {
 				a.second->stop();
@@ -1292,3 +2379,8 @@ namespace wsn {
 #include "ambient.h"
 #include "power.h"
 #include "comm.h"
+#include "energy.h"
+
+#include "coroutine.h"
+
+#include "archetype.h"
\ No newline at end of file
@@ -119,6 +119,7 @@
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
 #include <math.h>
+#include <stdlib.h>
 #include "spa.h"
 
 #define PI         3.1415926535897932384626433832795028841971
@@ -1171,3 +1172,98 @@ int spa_calculate(spa_data *spa)
     return result;
 }
 ///////////////////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Calculate zenith and azimuth over many times and sites
+// The geocentric terms only depend on time: they are calculated once per time, then the
+// topocentric terms for all the sites, from per-site constants calculated once per call
+///////////////////////////////////////////////////////////////////////////////////////////
+int validate_site(const spa_site *site)
+{
+    if ((site->pressure    < 0    ) || (site->pressure    > 5000)) return 12;
+    if ((site->temperature <= -273) || (site->temperature > 6000)) return 13;
+
+    if (fabs(site->longitude)     > 180     ) return 9;
+    if (fabs(site->latitude)      > 90      ) return 10;
+    if (fabs(site->atmos_refract) > 5       ) return 16;
+    if (     site->elevation      < -6500000) return 11;
+
+    return 0;
+}
+
+int spa_calculate_batch(const double *jd, int n_times, double delta_t,
+                        const spa_site *sites, int n_sites, double *zenith, double *azimuth)
+{
+    spa_data spa;
+    double *lon, *sin_lat, *cos_lat, *x, *y, *refract, *h0_prime;
+    double xi_rad, sin_xi, sin_delta, cos_delta;
+    int i, j, result;
+
+    if (fabs(delta_t) > 8000) return 7;
+    for (j = 0; j < n_sites; j++)
+        if ((result = validate_site(&sites[j])) != 0) return result;
+
+    lon = (double *)malloc(7 * n_sites * sizeof(double));
+    if (lon == NULL && n_sites > 0) return -1;
+
+    sin_lat  = lon     + n_sites;
+    cos_lat  = sin_lat + n_sites;
+    x        = cos_lat + n_sites;
+    y        = x       + n_sites;
+    refract  = y       + n_sites;
+    h0_prime = refract + n_sites;
+
+    for (j = 0; j < n_sites; j++)
+    {
+        double lat_rad = deg2rad(sites[j].latitude);
+        double u       = atan(0.99664719 * tan(lat_rad));
+
+        lon[j]      = sites[j].longitude;
+        sin_lat[j]  = sin(lat_rad);
+        cos_lat[j]  = cos(lat_rad);
+        x[j]        =              cos(u) + sites[j].elevation*cos_lat[j]/6378140.0;
+        y[j]        = 0.99664719 * sin(u) + sites[j].elevation*sin_lat[j]/6378140.0;
+        refract[j]  = (sites[j].pressure / 1010.0) * (283.0 / (273.0 + sites[j].temperature)) *
+                      1.02 / 60.0;
+        h0_prime[j] = -1*(SUN_RADIUS + sites[j].atmos_refract);
+    }
+
+    for (i = 0; i < n_times; i++)
+    {
+        double *zen = zenith  + (size_t)i * n_sites;
+        double *azm = azimuth + (size_t)i * n_sites;
+
+        spa.jd      = jd[i];
+        spa.delta_t = delta_t;
+        calculate_geocentric_sun_right_ascension_and_declination(&spa);
+
+        xi_rad    = deg2rad(sun_equatorial_horizontal_parallax(spa.r));
+        sin_xi    = sin(xi_rad);
+        sin_delta = sin(deg2rad(spa.delta));
+        cos_delta = cos(deg2rad(spa.delta));
+
+        // same steps as spa_calculate, kept in radians and without branches
+        for (j = 0; j < n_sites; j++)
+        {
+            double h_rad           = deg2rad(spa.nu + lon[j] - spa.alpha);
+            double cos_h           = cos(h_rad);
+            double den             = cos_delta - x[j]*sin_xi*cos_h;
+            double delta_alpha_rad = atan2(-x[j]*sin_xi*sin(h_rad), den);
+            double delta_prime_rad = atan2((sin_delta - y[j]*sin_xi)*cos(delta_alpha_rad), den);
+            double h_prime_rad     = h_rad - delta_alpha_rad;
+            double cos_h_prime     = cos(h_prime_rad);
+            double e0              = rad2deg(asin(sin_lat[j]*sin(delta_prime_rad) +
+                                                  cos_lat[j]*cos(delta_prime_rad)*cos_h_prime));
+            double del_e           = e0 >= h0_prime[j] ?
+                                     refract[j] / tan(deg2rad(e0 + 10.3/(e0 + 5.11))) : 0;
+
+            zen[j] = 90.0 - (e0 + del_e);
+            azm[j] = limit_degrees(rad2deg(atan2(sin(h_prime_rad),
+                     cos_h_prime*sin_lat[j] - tan(delta_prime_rad)*cos_lat[j])) + 180.0);
+        }
+    }
+
+    free(lon);
+
+    return 0;
+}
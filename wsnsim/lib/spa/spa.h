@@ -179,8 +179,21 @@ typedef struct
 
 } spa_data;
 
+//observer location for spa_calculate_batch (same units and ranges as in spa_data)
+typedef struct
+{
+    double longitude;     // error code: 9
+    double latitude;      // error code: 10
+    double elevation;     // error code: 11
+    double pressure;      // error code: 12
+    double temperature;   // error code: 13
+    double atmos_refract; // error code: 16
+} spa_site;
+
 //-------------- Utility functions for other applications (such as NREL's SAMPA) --------------
 double deg2rad(double degrees);
+double julian_day(int year, int month, int day, int hour, int minute, double second,
+                  double dut1, double tz);
 double rad2deg(double radians);
 double limit_degrees(double degrees);
 double third_order_polynomial(double a, double b, double c, double d, double x);
@@ -203,4 +216,10 @@ double topocentric_azimuth_angle(double azimuth_astro);
 //Calculate SPA output values (in structure) based on input values passed in structure
 int spa_calculate(spa_data *spa);
 
+//Calculate zenith and azimuth for every (time, site) pair: jd holds n_times julian days (see
+//julian_day), zenith and azimuth n_times*n_sites values, the sites of time i starting at i*n_sites.
+//Returns the error code of the first invalid input, as spa_calculate, or -1 when out of memory
+int spa_calculate_batch(const double *jd, int n_times, double delta_t,
+                        const spa_site *sites, int n_sites, double *zenith, double *azimuth);
+
 #endif
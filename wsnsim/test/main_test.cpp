@@ -2,6 +2,9 @@
 #include "test2.h"
 #include "test3.h"
 #include "test4.h"
+#include "test5.h"
+#include "test6.h"
+#include "test7.h"
 #include "test_phuong_phd_scenario1.h"
 
 namespace the_test = test_phuong_phd_scenario1;
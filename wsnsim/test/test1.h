@@ -23,6 +23,8 @@ namespace test1 {
 		bool is_charging = 0;
 		chrono::duration<double> sampling_time;
 
+		behaviour run(basic_node& node);
+
 	public:
 		void init() override;
 
@@ -55,22 +57,29 @@ namespace test1 {
 		});
 
 		node->on(basic_battery::event_consume, [this](event& ev, double d) {
-			if (dynamic_pointer_cast<basic_battery>(ev.target)->get_soc() <= 0.2)
+			if (ev.get_target<basic_battery>()->get_soc() <= 0.2)
 				is_charging = true;
 		});
 
 		node->on_self(entity::event_first_start, [this, node](event& ev) {
-			timer(sampling_time, true, [this, node](event& ev) {
-				auto battery = node->get_battery();
+			spawn(*this, run(*node));
+		});
+	}
 
-				if (is_charging) {
-					battery->charge(sampling_time.count());
-				}
+	inline behaviour controller_measure_then_sleep::run(basic_node& node)
+	{
+		while (true) {
+			co_await sleep_for(sampling_time);
 
-				if (battery->consume(sampling_time.count()))
-					node->get_sensor()->measure();
-				});
-		});
+			auto battery = node.get_battery();
+
+			if (is_charging) {
+				battery->charge(sampling_time.count());
+			}
+
+			if (battery->consume(sampling_time.count()))
+				node.get_sensor()->measure();
+		}
 	}
 
 
@@ -95,7 +104,7 @@ namespace test1 {
 			ref_frame.set_timezone(7);
 
 			auto& clock = world->get_clock();
-			clock.set(clock::mktime(2018, 5, 23, 5, 0, 0), 3600);
+			clock.set(clock::mktime(2018, 5, 23, 5, 0, 0, ref_frame.get_timezone()), 3600);
 
 			auto temp_ambient = world->new_ambient<smooth_real_value_ambient>(basic_ambient::temperature, 25, 1. / 3600);
 			auto humidity_ambient = world->new_ambient<smooth_real_value_ambient>(basic_ambient::humidity, 80, 1. / 2000);
@@ -141,7 +150,7 @@ namespace test1 {
 
 
 			wsn->on(basic_sensor::event_measure, [](event& ev, std::any value, double time) {
-				auto n = dynamic_pointer_cast<basic_sensor>(ev.target)->get_node();
+				auto n = ev.get_target<basic_sensor>()->get_node();
 
 				lock_guard lock(writemx);
 				cout << format_time(n->get_reference_time()) << ": "
@@ -149,7 +158,7 @@ namespace test1 {
 			});
 
 			wsn->on(basic_node::event_start, [](event& ev) {
-				if (auto n = dynamic_pointer_cast<simple_node>(ev.target); n) {
+				if (auto n = ev.get_target<simple_node>(); n) {
 					lock_guard lock(writemx);
 					cout << format_time(n->get_reference_time()) << ": "
 						<< "Node " << n->get_name() << " (" << n->get_id() << ") started" << endl;
@@ -158,7 +167,7 @@ namespace test1 {
 			});
 
 			wsn->on(basic_node::event_stop, [](event& ev) {
-				if (auto n = dynamic_pointer_cast<simple_node>(ev.target); n) {
+				if (auto n = ev.get_target<simple_node>(); n) {
 					lock_guard lock(writemx);
 					cout << format_time(n->get_reference_time()) << ": "
 						<< "Node " << n->get_name() << " (" << n->get_id() << ") stopped" << endl;
@@ -167,7 +176,7 @@ namespace test1 {
 
 			wsn->on(basic_battery::event_charge, [](event& ev, double d) {
 				lock_guard lock(writemx);
-				auto n = dynamic_pointer_cast<basic_battery>(ev.target)->get_node();
+				auto n = ev.get_target<basic_battery>()->get_node();
 				cout << format_time(n->get_reference_time()) << ": "
 					<< "Node " << n->get_name() << " (" << n->get_id() << ") charged, level = " << n->get_battery()->get_soc() << endl;
 				log_info(n);
@@ -175,14 +184,14 @@ namespace test1 {
 
 			wsn->on(basic_battery::event_consume, [](event& ev, double d) {
 				lock_guard lock(writemx);
-				auto n = dynamic_pointer_cast<basic_battery>(ev.target)->get_node();
+				auto n = ev.get_target<basic_battery>()->get_node();
 				cout << format_time(n->get_reference_time()) << ": "
 					<< "Node " << n->get_name() << " (" << n->get_id() << ") consumed, level = " << n->get_battery()->get_soc() << endl;
 				log_info(n);
 			});
 
 			wsn->on(basic_battery::event_empty, [](event& ev) {
-				auto n = dynamic_pointer_cast<basic_battery>(ev.target)->get_node();
+				auto n = ev.get_target<basic_battery>()->get_node();
 				{
 					lock_guard lock(writemx);
 					cout << format_time(n->get_reference_time()) << ": "
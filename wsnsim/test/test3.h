@@ -154,7 +154,7 @@ namespace test3 {
 			ref_frame.set_timezone(7);
 
 			auto& clock = world->get_clock();
-			clock.set(clock::mktime(2018, 5, 1, 12, 0, 0), 20);
+			clock.set(clock::mktime(2018, 5, 1, 12, 0, 0, ref_frame.get_timezone()), 20);
 
 			auto temp_ambient = world->new_ambient<smooth_real_value_ambient>(basic_ambient::temperature, 25, 1. / 3600);
 
@@ -223,7 +223,7 @@ namespace test3 {
 
 
 			wsn->on(basic_node::event_start, [](event& ev) {
-				if (auto n = dynamic_pointer_cast<temp_node>(ev.target); n) {
+				if (auto n = ev.get_target<temp_node>(); n) {
 					lock_guard lock(writemx);
 					auto loc = n->get_location();
 					cout << format_time(n->get_reference_time()) << ": "
@@ -232,7 +232,7 @@ namespace test3 {
 			});
 
 			wsn->on(basic_node::event_stop, [](event& ev) {
-				if (auto n = dynamic_pointer_cast<temp_node>(ev.target); n) {
+				if (auto n = ev.get_target<temp_node>(); n) {
 					lock_guard lock(writemx);
 					cout << format_time(n->get_reference_time()) << ": "
 						<< "Node " << n->get_name() << " (" << n->get_id() << ") stopped" << endl;
@@ -1,4 +1,5 @@
 #include "common.h"
+#include <atomic>
 
 
 using namespace std;
@@ -13,6 +14,7 @@ namespace test4 {
 
 	shared_ptr<basic_node> master_node;
 	double measure_time;
+	atomic<uint> sent_messages{ 0 };
 
 
 	void log_info(shared_ptr<basic_node> node, shared_ptr<basic_node> from, double t, const char* action) {
@@ -49,6 +51,10 @@ namespace test4 {
 				}
 			});
 
+			node->on(basic_comm::event_send, [node](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> to) {
+				sent_messages++;
+			});
+
 			node->on(basic_comm::event_receive, [node](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) {
 				double t = node->get_world_clock_time();
 
@@ -87,10 +93,9 @@ namespace test4 {
 
 	class custom_comm : public with_super<
 		comm::packaged<
-		comm::spanning_tree_routing<
 		comm::broadcast_routing<
 		comm::with_loss<
-		comm::with_delay_linear<basic_comm>>>>>> {
+		comm::with_delay_linear<basic_comm>>>>> {
 	public:
 		void init() override {
 			super::init();
@@ -121,6 +126,72 @@ namespace test4 {
 
 
 
+	// the comm layer hooks bound statically (crtp) and through virtuals (generic), for the bench-hooks command.
+	// frames carry their message id up front
+	class crtp_hooks_comm : public comm::loop_avoidance_crtp<crtp_hooks_comm, uint, comm::with_delay_crtp<crtp_hooks_comm, basic_comm>> {
+	public:
+		using with_delay_crtp::delay_to;
+
+		std::chrono::duration<double> calc_delay(std::shared_ptr<basic_node> to) {
+			return 1ms * get_node_ref().get_location().distance_to(to->get_location());
+		}
+
+		uint get_message_id(const std::vector<uchar>& data) const {
+			return *(const uint*)data.data();
+		}
+	};
+
+	class generic_hooks_comm : public comm::loop_avoidance<uint, comm::with_delay_generic<basic_comm>> {
+	public:
+		using with_delay_generic::delay_to;
+
+		std::chrono::duration<double> calc_delay(std::shared_ptr<basic_node> to) override {
+			return 1ms * get_node_ref().get_location().distance_to(to->get_location());
+		}
+
+		uint get_message_id(const std::vector<uchar>& data) const override {
+			return *(const uint*)data.data();
+		}
+	};
+
+	template <typename comm_type>
+	class bench_node : public generic_node<comm_type, sensor::none, battery::none, power::none, basic_controller> {
+	public:
+		using generic_node<comm_type, sensor::none, battery::none, power::none, basic_controller>::generic_node;
+	};
+
+	// ns per received frame and per delay computed, on the first of the given nodes
+	template <typename comm_type>
+	pair<double, double> bench_hooks(const basic_comm::node_list& nodes, uint count) {
+		auto comm = dynamic_pointer_cast<bench_node<comm_type>>(nodes[0])->get_comm_t();
+		comm->set_max_last_messages(10);
+
+		vector<shared_ptr<vector<uchar>>> frames;
+		for (uint i = 0; i < count; i++) {
+			frames.push_back(make_shared<vector<uchar>>(sizeof(uint) + 16));
+			*(uint*)frames.back()->data() = i + 1;
+		}
+
+		auto t0 = chrono::steady_clock::now();
+		for (auto& f : frames) comm->receive(f, nodes[1]);
+
+		auto t1 = chrono::steady_clock::now();
+		double sum = 0;
+		for (uint i = 0; i < count / nodes.size(); i++)
+			for (auto& to : nodes) sum += comm->delay_to(to).count();
+
+		auto t2 = chrono::steady_clock::now();
+		assert(sum > 0);
+		return {
+			chrono::duration<double, nano>(t1 - t0).count() / count,
+			chrono::duration<double, nano>(t2 - t1).count() / (count / nodes.size() * nodes.size())
+		};
+	}
+
+
+
+
+
 	class custom_test_case : public test_case {
 	public:
 		string get_test_name() const override {
@@ -145,7 +216,7 @@ namespace test4 {
 			ref_frame.set_timezone(7);
 
 			auto& clock = world->get_clock();
-			clock.set(clock::mktime(2018, 5, 1, 12, 0, 0), 20);
+			clock.set(clock::mktime(2018, 5, 1, 12, 0, 0, ref_frame.get_timezone()), 20);
 
 			auto temp_ambient = world->new_ambient<smooth_real_value_ambient>(basic_ambient::temperature, 25, 1. / 3600);
 
@@ -173,7 +244,7 @@ namespace test4 {
 
 
 			wsn->on(basic_node::event_start, [](event& ev) {
-				if (auto n = dynamic_pointer_cast<temp_node>(ev.target); n) {
+				if (auto n = ev.get_target<temp_node>(); n) {
 					lock_guard lock(writemx);
 					auto loc = n->get_location();
 					cout << format_time(n->get_reference_time()) << ": "
@@ -182,7 +253,7 @@ namespace test4 {
 			});
 
 			wsn->on(basic_node::event_stop, [](event& ev) {
-				if (auto n = dynamic_pointer_cast<temp_node>(ev.target); n) {
+				if (auto n = ev.get_target<temp_node>(); n) {
 					lock_guard lock(writemx);
 					cout << format_time(n->get_reference_time()) << ": "
 						<< "Node " << n->get_name() << " (" << n->get_id() << ") stopped" << endl;
@@ -227,6 +298,32 @@ namespace test4 {
 				});
 			});
 
+			add_command("traffic", [this]() {
+				cout << "Messages sent: " << sent_messages << endl;
+			});
+
+			// per-packet cost of the statically bound layer hooks against the virtual ones, in a world of its own
+			add_command("bench-hooks", [this](auto& cmd, auto& args) {
+				uint count = args.size() > 0 ? stoi(args[0]) : 400000;
+
+				auto bench_world = generic_world<basic_network>::new_world();
+				auto bench_wsn = bench_world->get_network();
+
+				basic_comm::node_list crtp_nodes, generic_nodes;
+				for (uint i = 0; i < 64; i++) {
+					crtp_nodes.push_back(bench_wsn->new_node<bench_node<crtp_hooks_comm>>(kutils::formatstr("crtp%d", i + 1), location(i, 0, 0)));
+					generic_nodes.push_back(bench_wsn->new_node<bench_node<generic_hooks_comm>>(kutils::formatstr("generic%d", i + 1), location(i, 0, 0)));
+				}
+
+				bench_world->start();
+				auto crtp = bench_hooks<crtp_hooks_comm>(crtp_nodes, count);
+				auto generic = bench_hooks<generic_hooks_comm>(generic_nodes, count);
+				bench_world->stop();
+
+				cout << "receive: " << crtp.first << " ns/packet crtp, " << generic.first << " ns/packet generic" << endl;
+				cout << "calc_delay: " << crtp.second << " ns/receiver crtp, " << generic.second << " ns/receiver generic" << endl;
+			});
+
 			add_command("set-loss-rate", [this](auto& cmd, auto& args) {
 				if (args.size() != 1) {
 					cout << cmd << " loss-rate" << endl;
@@ -0,0 +1,299 @@
+#include "common.h"
+#include <atomic>
+
+
+using namespace std;
+using namespace wsn;
+
+
+
+namespace test5 {
+
+
+	mutex writemx;
+
+	shared_ptr<basic_node> master_node;
+	double measure_time;
+	atomic<uint> sent_messages{ 0 };
+
+
+	void log_info(shared_ptr<basic_node> node, shared_ptr<basic_node> from, double t, const char* action) {
+		logger.log(kutils::formatstr("%s\t%s\t%s",
+			node->get_name().c_str(),
+			(from ? from->get_name().c_str() : "-"),
+			action));
+	}
+
+
+	class controller_measure_then_sleep : public basic_controller {
+	protected:
+		chrono::duration<double> sampling_time;
+
+	public:
+		void init() override;
+
+		template <typename _Rep, typename _Period>
+		void set_sampling_time(chrono::duration<_Rep, _Period> st) {
+			sampling_time = chrono::duration_cast<chrono::duration<double>>(st);
+		}
+	};
+
+
+
+	class custom_comm : public with_super<
+		comm::packaged<
+		comm::spanning_tree_routing<
+		comm::with_loss<
+		comm::with_delay_linear<basic_comm>>>>> {
+	public:
+		void init() override {
+			super::init();
+
+			on_self(event_first_start, [this](event& ev) {
+				set_delay(10ms, 5ms, 1ms, 0ms, 0ms);
+				set_tree_range(5);
+				set_epoch(1min);
+				set_aggregation(aggregation_type::mean);
+
+				set_loss_rate(0.1);
+			});
+		}
+	};
+
+
+	class temp_node : public generic_node<
+		custom_comm,
+		sensor::with_noise<sensor::with_ambient<basic_sensor>>,
+		battery::linear,
+		power::none,
+		controller_measure_then_sleep> {
+	public:
+		using generic_node<custom_comm, sensor::with_noise<sensor::with_ambient<basic_sensor>>, battery::linear, power::none, controller_measure_then_sleep>::generic_node;
+	};
+
+
+
+	inline void controller_measure_then_sleep::init()
+	{
+		basic_controller::init();
+
+		auto node = dynamic_pointer_cast<temp_node>(get_node());
+
+		// measurements are aggregated on their way to the sink instead of being routed one by one
+		node->on(basic_sensor::event_measure, [node](event& ev, any value, double time) {
+			double t = node->get_world_clock_time();
+			measure_time = t;
+
+			{
+				lock_guard lock(writemx);
+				cout << format_time(t) << ": Node " << node->get_name() << " (" << node->get_id() << ") measurement updated: " << any_cast<double>(value) << endl;
+				log_info(node, nullptr, t, "measure");
+			}
+
+			node->get_comm_t()->contribute(any_cast<double>(value));
+		});
+
+		node->on(custom_comm::event_aggregate, [node](event& ev, double value, uint count) {
+			double t = node->get_world_clock_time();
+
+			lock_guard lock(writemx);
+			cout << format_time(t) << ": Node " << node->get_name() << " (" << node->get_id() << ") aggregated "
+				<< count << " measurements: " << value << endl;
+			log_info(node, nullptr, t, "aggregate");
+		});
+
+		node->on(basic_comm::event_send, [node](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> to) {
+			sent_messages++;
+		});
+
+		node->on(basic_comm::event_receive, [node](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) {
+			double t = node->get_world_clock_time();
+
+			lock_guard lock(writemx);
+			cout << format_time(t) << ": Node " << node->get_name() << " (" << node->get_id() << ") received from "
+				<< from->get_name() << " (" << from->get_id() << "): " << format_binary_string(*data) << endl;
+			log_info(node, from, t, "receive");
+		});
+
+		node->on(basic_comm::event_forward, [node](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) {
+			double t = node->get_world_clock_time();
+
+			lock_guard lock(writemx);
+			cout << format_time(t) << ": Node " << node->get_name() << " (" << node->get_id() << ") forwarded "
+				<< data->size() << " bytes for " << from->get_name() << " (" << from->get_id() << ")" << endl;
+			log_info(node, from, t, "forward");
+		});
+
+		node->on(basic_comm::event_drop, [node](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) {
+			double t = node->get_world_clock_time();
+
+			lock_guard lock(writemx);
+			cout << format_time(t) << ": Node " << node->get_name() << " (" << node->get_id() << ") dropped "
+				<< data->size() << " bytes from " << from->get_name() << " (" << from->get_id() << ")" << endl;
+			log_info(node, from, t, "drop");
+		});
+	}
+
+
+
+
+
+	class custom_test_case : public test_case {
+	protected:
+		// all nodes are identical, stored with their components side by side
+		shared_ptr<archetype<temp_node>> storage = make_shared<archetype<temp_node>>();
+		battery::batch<battery::linear> drain;
+
+	public:
+		string get_test_name() const override {
+			return "test5";
+		}
+
+		string get_test_description() const override {
+			return "Spanning tree convergecast with in-network aggregation";
+		}
+
+		void print_node_info(shared_ptr<basic_node> node, ostream& stream) override {
+			auto loc = node->get_location();
+			stream << node->get_id() << "\t" << node->get_name() << "\t" << loc.x << "\t" << loc.y << "\t" << loc.z
+				<< "\t" << (node->is_started() ? "started" : "stopped") << endl;
+		}
+
+		void setup() override {
+			world = generic_world<basic_network>::new_world();
+
+			auto& ref_frame = world->get_reference_frame();
+			ref_frame.set_frame(21.0041527314897, 105.84660046011209, 0., 21.00420833245197, 105.84666804469794, 0.);
+			ref_frame.set_timezone(7);
+
+			auto& clock = world->get_clock();
+			clock.set(clock::mktime(2018, 5, 1, 12, 0, 0, ref_frame.get_timezone()), 20);
+
+			auto temp_ambient = world->new_ambient<smooth_real_value_ambient>(basic_ambient::temperature, 25, 1. / 3600);
+
+			auto wsn = world->get_network();
+
+			std::default_random_engine random_generator((uint)time(NULL));
+			std::uniform_real_distribution<double> random30(0., 30.);
+
+			for (uint i = 0; i < 150; i++) {
+				location loc;
+				if (i == 0) loc = location(0, 0, 0);
+				else if (i == 1) loc = location(20, 20, 0);
+				else loc = location(random30(random_generator), random30(random_generator), 0.);
+
+				auto node = storage->new_node(wsn, kutils::formatstr("temp%d", i + 1), loc);
+
+				auto sensor = node->get_sensor_t();
+				sensor->set_ambient(temp_ambient);
+				sensor->add_noise(make_shared<noise::gaussian>(0., 3.));
+
+				node->get_battery_t()->set_consume_rate(100. / 86400);	// a day on a full battery
+
+				if (i == 0) {
+					master_node = node;
+					node->get_comm_t()->set_sink(true);
+				}
+			}
+
+
+
+
+			wsn->on(basic_node::event_start, [](event& ev) {
+				if (auto n = ev.get_target<temp_node>(); n) {
+					lock_guard lock(writemx);
+					auto loc = n->get_location();
+					cout << format_time(n->get_reference_time()) << ": "
+						<< "Node " << n->get_name() << " (" << n->get_id() << ") started: " << loc.x << ", " << loc.y << ", " << loc.z << endl;
+				}
+			});
+
+			wsn->on(basic_node::event_stop, [](event& ev) {
+				if (auto n = ev.get_target<temp_node>(); n) {
+					lock_guard lock(writemx);
+					cout << format_time(n->get_reference_time()) << ": "
+						<< "Node " << n->get_name() << " (" << n->get_id() << ") stopped" << endl;
+				}
+			});
+
+			wsn->on(basic_battery::event_empty, [](event& ev) {
+				auto n = ev.get_target<basic_battery>()->get_node();
+				{
+					lock_guard lock(writemx);
+					cout << format_time(n->get_reference_time()) << ": "
+						<< "Node " << n->get_name() << " (" << n->get_id() << ") battery empty" << endl;
+				}
+				n->stop();
+			});
+
+			// the nodes draw the same current all day long: one pass over the stored batteries
+			// per minute instead of a timer per node. nodes removed meanwhile wait for the pass
+			world->timer(1min, true, [this](event& ev) {
+				storage->run_system([this]() {
+					drain.clear();
+					storage->each_battery([this](battery::linear& b) {
+						if (b.is_started()) drain.add(b);
+					});
+					drain.consume(60);
+				});
+			});
+
+
+			add_command("measure", [this](auto& cmd, auto& args) {
+				if (args.size() != 1) {
+					cout << cmd << " node-name" << endl;
+					return;
+				}
+
+				auto node = world->get_network()->node_by_name(args[0]);
+				if (!node) {
+					cout << "Node node found: " << args[0] << endl;
+					return;
+				}
+
+				node->get_sensor()->measure();
+			});
+
+			add_command("set-range", [this](auto& cmd, auto& args) {
+				if (args.size() != 1) {
+					cout << cmd << " range" << endl;
+					return;
+				}
+
+				world->get_network()->each_node([range = stod(args[0])](auto node) {
+					dynamic_pointer_cast<temp_node>(node)->get_comm_t()->set_tree_range(range);
+				});
+			});
+
+			add_command("rebuild-tree", [this]() {
+				dynamic_pointer_cast<temp_node>(master_node)->get_comm_t()->rebuild();
+			});
+
+			add_command("traffic", [this]() {
+				cout << "Messages sent: " << sent_messages << endl;
+			});
+
+			add_command("set-loss-rate", [this](auto& cmd, auto& args) {
+				if (args.size() != 1) {
+					cout << cmd << " loss-rate" << endl;
+					return;
+				}
+
+				world->get_network()->each_node([rate = stod(args[0])](auto node) {
+					dynamic_pointer_cast<temp_node>(node)->get_comm_t()->set_loss_rate(rate);
+				});
+			});
+		}
+
+
+		static void create_test_case()
+		{
+			auto tc = make_shared<custom_test_case>();
+			test_case::instance = tc;
+			tc->init();
+		}
+	};
+
+
+
+}
\ No newline at end of file
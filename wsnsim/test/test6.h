@@ -0,0 +1,213 @@
+#include "common.h"
+#include <atomic>
+
+
+using namespace std;
+using namespace wsn;
+
+
+
+namespace test6 {
+
+
+	mutex writemx;
+
+	shared_ptr<basic_node> master_node;
+	atomic<uint> sent_messages{ 0 };
+
+
+	void log_info(shared_ptr<basic_node> node, shared_ptr<basic_node> from, double t, const char* action) {
+		logger.log(kutils::formatstr("%s\t%s\t%s",
+			node->get_name().c_str(),
+			(from ? from->get_name().c_str() : "-"),
+			action));
+	}
+
+
+
+	// the tree is built over broadcast_routing rather than straight over the radio: its control frames
+	// and aggregates go through a routing layer, which has to carry its own header on them
+	class custom_comm : public with_super<
+		comm::packaged<
+		comm::spanning_tree_routing<
+		comm::broadcast_routing<
+		comm::with_loss<
+		comm::with_delay_linear<basic_comm>>>>>> {
+	public:
+		void init() override {
+			super::init();
+
+			on_self(event_first_start, [this](event& ev) {
+				set_delay(10ms, 5ms, 1ms, 0ms, 0ms);
+				set_tree_range(5);
+				set_epoch(1min);
+				set_aggregation(aggregation_type::mean);
+				set_max_last_messages(10);
+
+				set_loss_rate(0.1);
+			});
+		}
+	};
+
+
+	class temp_node : public generic_node<
+		custom_comm,
+		sensor::with_noise<sensor::with_ambient<basic_sensor>>,
+		battery::none,
+		power::none,
+		basic_controller> {
+	public:
+		using generic_node<custom_comm, sensor::with_noise<sensor::with_ambient<basic_sensor>>, battery::none, power::none, basic_controller>::generic_node;
+	};
+
+
+
+
+
+	class custom_test_case : public test_case {
+	protected:
+		// nodes that joined the sink's tree, and the depth of the deepest one. a node whose parents
+		// don't lead to the sink within as many hops as there are nodes is counted as looping
+		void check_tree() {
+			auto wsn = world->get_network();
+			auto nodes = wsn->get_nodes();
+
+			uint joined = 0, looping = 0, depth = 0;
+			for (auto& n : nodes) {
+				auto comm = dynamic_pointer_cast<temp_node>(n)->get_comm_t();
+				if (!n->is_started() || comm->get_root_id() != master_node->get_id()) continue;
+				joined++;
+
+				uint hops = 0;
+				auto p = n;
+				while (p && !p->is_same(master_node) && hops <= nodes.size()) {
+					p = dynamic_pointer_cast<temp_node>(p)->get_comm_t()->get_parent();
+					hops++;
+				}
+
+				if (!p || hops > nodes.size()) looping++;
+				else depth = max(depth, hops);
+			}
+
+			lock_guard lock(writemx);
+			cout << format_time(world->get_clock().clock_now()) << ": " << joined << " of " << nodes.size() << " nodes in the tree of "
+				<< master_node->get_name() << ", depth " << depth << ", " << looping << " not reaching it" << endl;
+		}
+
+	public:
+		string get_test_name() const override {
+			return "test6";
+		}
+
+		string get_test_description() const override {
+			return "Spanning tree over broadcast routing";
+		}
+
+		void print_node_info(shared_ptr<basic_node> node, ostream& stream) override {
+			auto loc = node->get_location();
+			auto parent = dynamic_pointer_cast<temp_node>(node)->get_comm_t()->get_parent();
+			stream << node->get_id() << "\t" << node->get_name() << "\t" << loc.x << "\t" << loc.y << "\t" << loc.z
+				<< "\t" << (parent ? parent->get_name() : "-")
+				<< "\t" << (node->is_started() ? "started" : "stopped") << endl;
+		}
+
+		void setup() override {
+			world = generic_world<basic_network>::new_world();
+
+			auto& ref_frame = world->get_reference_frame();
+			ref_frame.set_frame(21.0041527314897, 105.84660046011209, 0., 21.00420833245197, 105.84666804469794, 0.);
+			ref_frame.set_timezone(7);
+
+			auto& clock = world->get_clock();
+			clock.set(clock::mktime(2018, 5, 1, 12, 0, 0, ref_frame.get_timezone()), 20);
+
+			auto temp_ambient = world->new_ambient<smooth_real_value_ambient>(basic_ambient::temperature, 25, 1. / 3600);
+
+			auto wsn = world->get_network();
+
+			std::default_random_engine random_generator((uint)time(NULL));
+			std::uniform_real_distribution<double> random30(0., 30.);
+
+			for (uint i = 0; i < 150; i++) {
+				location loc;
+				if (i == 0) loc = location(0, 0, 0);
+				else if (i == 1) loc = location(20, 20, 0);
+				else loc = location(random30(random_generator), random30(random_generator), 0.);
+
+				auto node = wsn->new_node<temp_node>(kutils::formatstr("temp%d", i + 1), loc);
+
+				auto sensor = node->get_sensor_t();
+				sensor->set_ambient(temp_ambient);
+				sensor->add_noise(make_shared<noise::gaussian>(0., 3.));
+
+				node->on(basic_sensor::event_measure, [node](event& ev, any value, double time) {
+					node->get_comm_t()->contribute(any_cast<double>(value));
+				});
+
+				node->on(basic_comm::event_send, [](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> to) {
+					sent_messages++;
+				});
+
+				if (i == 0) {
+					master_node = node;
+					node->get_comm_t()->set_sink(true);
+				}
+			}
+
+			wsn->on(custom_comm::event_aggregate, [](event& ev, double value, uint count) {
+				auto n = ev.get_target<custom_comm>()->get_node();
+
+				lock_guard lock(writemx);
+				cout << format_time(n->get_reference_time()) << ": Node " << n->get_name() << " (" << n->get_id() << ") aggregated "
+					<< count << " measurements: " << value << endl;
+				log_info(n, nullptr, n->get_world_clock_time(), "aggregate");
+			});
+
+			// the tree settles within seconds, it is checked once a minute in
+			world->timer_once(1min, true, [this](event& ev) {
+				check_tree();
+			});
+
+
+			add_command("tree", [this]() {
+				check_tree();
+			});
+
+			add_command("measure-all", [this]() {
+				world->get_network()->each_node([](auto node) {
+					node->get_sensor()->measure();
+				});
+			});
+
+			add_command("rebuild-tree", [this]() {
+				dynamic_pointer_cast<temp_node>(master_node)->get_comm_t()->rebuild();
+			});
+
+			add_command("traffic", [this]() {
+				cout << "Messages sent: " << sent_messages << endl;
+			});
+
+			add_command("set-loss-rate", [this](auto& cmd, auto& args) {
+				if (args.size() != 1) {
+					cout << cmd << " loss-rate" << endl;
+					return;
+				}
+
+				world->get_network()->each_node([rate = stod(args[0])](auto node) {
+					dynamic_pointer_cast<temp_node>(node)->get_comm_t()->set_loss_rate(rate);
+				});
+			});
+		}
+
+
+		static void create_test_case()
+		{
+			auto tc = make_shared<custom_test_case>();
+			test_case::instance = tc;
+			tc->init();
+		}
+	};
+
+
+
+}
@@ -0,0 +1,211 @@
+#include "common.h"
+#include <atomic>
+
+
+using namespace std;
+using namespace wsn;
+
+
+
+namespace test7 {
+
+
+	mutex writemx;
+
+	shared_ptr<basic_node> master_node;
+	atomic<uint> sent_messages{ 0 }, delivered_messages{ 0 }, dropped_messages{ 0 };
+
+
+	class custom_comm : public with_super<
+		comm::packaged<
+		comm::table_routing<
+		comm::with_loss<
+		comm::with_delay_linear<basic_comm>>>>> {
+	public:
+		void init() override {
+			super::init();
+
+			on_self(event_first_start, [this](event& ev) {
+				set_delay(10ms, 5ms, 1ms, 0ms, 0ms);
+				set_loss_rate(0.1);
+			});
+		}
+
+		// counts the readings that made it to the master, whole
+		bool receive(std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) override {
+			if (!super::receive(data, from)) return false;
+
+			delivered_messages++;
+			return true;
+		}
+	};
+
+
+	class temp_node : public generic_node<
+		custom_comm,
+		sensor::with_noise<sensor::with_ambient<basic_sensor>>,
+		battery::none,
+		power::none,
+		basic_controller> {
+	public:
+		using generic_node<custom_comm, sensor::with_noise<sensor::with_ambient<basic_sensor>>, battery::none, power::none, basic_controller>::generic_node;
+	};
+
+
+
+
+
+	class custom_test_case : public test_case {
+	protected:
+		shared_ptr<comm::routing_table> table;
+
+		void kill(shared_ptr<basic_node> node) {
+			node->stop();
+
+			lock_guard lock(writemx);
+			cout << format_time(node->get_reference_time()) << ": Node " << node->get_name() << " (" << node->get_id() << ") killed, "
+				<< delivered_messages << " readings delivered so far" << endl;
+		}
+
+	public:
+		string get_test_name() const override {
+			return "test7";
+		}
+
+		string get_test_description() const override {
+			return "Shortest path routing over a shared routing table";
+		}
+
+		void print_node_info(shared_ptr<basic_node> node, ostream& stream) override {
+			auto loc = node->get_location();
+			auto next = table->next_hop(node->get_id(), master_node->get_id());
+			stream << node->get_id() << "\t" << node->get_name() << "\t" << loc.x << "\t" << loc.y << "\t" << loc.z
+				<< "\t" << (next ? next->get_name() : "-") << "\t" << table->cost(node->get_id(), master_node->get_id())
+				<< "\t" << (node->is_started() ? "started" : "stopped") << endl;
+		}
+
+		void setup() override {
+			world = generic_world<basic_network>::new_world();
+
+			auto& ref_frame = world->get_reference_frame();
+			ref_frame.set_frame(21.0041527314897, 105.84660046011209, 0., 21.00420833245197, 105.84666804469794, 0.);
+			ref_frame.set_timezone(7);
+
+			auto& clock = world->get_clock();
+			clock.set(clock::mktime(2018, 5, 1, 12, 0, 0, ref_frame.get_timezone()), 20);
+
+			auto temp_ambient = world->new_ambient<smooth_real_value_ambient>(basic_ambient::temperature, 25, 1. / 3600);
+
+			auto wsn = world->get_network();
+			table = make_shared<comm::routing_table>(wsn, 5.);
+
+			std::default_random_engine random_generator((uint)time(NULL));
+			std::uniform_real_distribution<double> random30(0., 30.);
+
+			for (uint i = 0; i < 150; i++) {
+				location loc;
+				if (i == 0) loc = location(0, 0, 0);
+				else if (i == 1) loc = location(20, 20, 0);
+				else loc = location(random30(random_generator), random30(random_generator), 0.);
+
+				auto node = wsn->new_node<temp_node>(kutils::formatstr("temp%d", i + 1), loc);
+
+				auto sensor = node->get_sensor_t();
+				sensor->set_ambient(temp_ambient);
+				sensor->add_noise(make_shared<noise::gaussian>(0., 3.));
+
+				node->get_comm_t()->set_routing_table(table);
+
+				if (i == 0) master_node = node;
+				else {
+					node->on(basic_sensor::event_measure, [node](event& ev, any value, double time) {
+						string msg = kutils::formatstr("node %d value %.3lf", node->get_id(), any_cast<double>(value));
+						node->get_comm()->route(std::vector<uchar>(msg.begin(), msg.end()), master_node);
+					});
+				}
+			}
+
+			wsn->on(basic_comm::event_send, [](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> to) {
+				sent_messages++;
+			});
+
+			wsn->on(basic_comm::event_drop, [](event& ev, std::shared_ptr<std::vector<uchar>> data, std::shared_ptr<basic_node> from) {
+				dropped_messages++;
+			});
+
+			// every node reports once a minute
+			world->timer(1min, true, [this](event& ev) {
+				world->get_network()->each_active_node([](basic_node& node) {
+					node.get_sensor()->measure();
+				});
+			});
+
+			// partway through, the relay next to the master on the way from the far corner goes down:
+			// the table is repaired in place and the readings go around it
+			world->timer_once(150s, true, [this](event& ev) {
+				auto far_node = world->get_network()->node_by_name("temp2");
+				shared_ptr<basic_node> relay, next = far_node;
+				while (next && !next->is_same(master_node)) {
+					relay = next;
+					next = table->next_hop(next->get_id(), master_node->get_id());
+				}
+
+				if (relay && !relay->is_same(far_node)) kill(relay);
+			});
+
+
+			add_command("kill", [this](auto& cmd, auto& args) {
+				if (args.size() != 1) {
+					cout << cmd << " node-name" << endl;
+					return;
+				}
+
+				auto node = world->get_network()->node_by_name(args[0]);
+				if (!node) {
+					cout << "Node node found: " << args[0] << endl;
+					return;
+				}
+
+				kill(node);
+			});
+
+			add_command("set-htl", [this](auto& cmd, auto& args) {
+				if (args.size() != 1) {
+					cout << cmd << " hops" << endl;
+					return;
+				}
+
+				world->get_network()->each_node([hops = stoi(args[0])](auto node) {
+					dynamic_pointer_cast<temp_node>(node)->get_comm_t()->set_hops_to_live(hops);
+				});
+			});
+
+			add_command("traffic", [this]() {
+				cout << "Messages sent: " << sent_messages << ", readings delivered: " << delivered_messages
+					<< ", dropped: " << dropped_messages << endl;
+			});
+
+			add_command("set-loss-rate", [this](auto& cmd, auto& args) {
+				if (args.size() != 1) {
+					cout << cmd << " loss-rate" << endl;
+					return;
+				}
+
+				world->get_network()->each_node([rate = stod(args[0])](auto node) {
+					dynamic_pointer_cast<temp_node>(node)->get_comm_t()->set_loss_rate(rate);
+				});
+			});
+		}
+
+
+		static void create_test_case()
+		{
+			auto tc = make_shared<custom_test_case>();
+			test_case::instance = tc;
+			tc->init();
+		}
+	};
+
+
+
+}
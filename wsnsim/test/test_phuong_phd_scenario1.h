@@ -8,7 +8,7 @@ using namespace wsn;
 
 
 namespace test_phuong_phd_scenario1 {
-	const std::chrono::system_clock::time_point schedule_start = clock::mktime(2020, 5, 23, 0, 0, 0);
+	const std::chrono::system_clock::time_point schedule_start = clock::mktime(2020, 5, 23, 0, 0, 0, 7);
 	const double runtime_limit = 3600. * 24 * 3;	// s
 
 	const double battery_max_level[] = { 3500 * 3.6, 3500 * 3.6 * 1.5, 3500 * 3.6 * 2 };
@@ -51,6 +51,13 @@ namespace test_phuong_phd_scenario1 {
 			{}
 		};
 
+		// a change of state at a clock time
+		class transition {
+		public:
+			double time;
+			bool active;
+		};
+
 		vector<vector<interval>> node_schedules;
 
 
@@ -89,6 +96,27 @@ namespace test_phuong_phd_scenario1 {
 			}
 		}
 
+		// the schedule of a node unrolled into clock times, from now (minutes_of_day past 00:00) until a
+		// clock time: the state in effect now first, then only the steps that change it
+		vector<transition> timeline(uint node_idx, double now, double minutes_of_day, double until) const {
+			auto& schedule = node_schedules[node_idx];
+
+			vector<transition> result;
+			result.push_back({ now, schedule[0].active });
+
+			for (double day = now - minutes_of_day * 60.; day < until; day += 24 * 3600.) {
+				for (auto& step : schedule) {
+					double t = day + step.start * 60.;
+					if (t >= until) break;
+
+					if (t <= now) result[0].active = step.active;
+					else if (step.active != result.back().active) result.push_back({ t, step.active });
+				}
+			}
+
+			return result;
+		}
+
 		void init_default() {
 			node_schedules.resize(sensor_nodes);
 
@@ -152,6 +180,17 @@ namespace test_phuong_phd_scenario1 {
 
 		bool active = false;
 
+		vector<network_schedule::transition> timeline;
+		size_t next_transition = 0;
+		uint transition_timer = 0;
+
+		void arm_next_transition();
+
+		// the battery is brought up to date only when the load changes, in the charge and consume steps of
+		// a sampling time the polling used to take; running out is left to expect_empty
+		void settle_battery();
+		void expect_battery_empty();
+
 	public:
 		void init() override;
 
@@ -170,6 +209,8 @@ namespace test_phuong_phd_scenario1 {
 			
 			auto battery = std::dynamic_pointer_cast<battery::chemical>(get_node()->get_battery());
 
+			if (is_started()) settle_battery();
+
 			battery->set_load(active ? battery_discharge_activate : battery_discharge_sleep);
 
 			if (is_started()) {
@@ -180,6 +221,8 @@ namespace test_phuong_phd_scenario1 {
 
 			battery->set_load(active ? battery_discharge_rate_active : battery_discharge_rate_inactive);
 			fire(active ? event_active : event_inactive);
+
+			if (is_started()) expect_battery_empty();
 		}
 	};
 
@@ -216,48 +259,88 @@ namespace test_phuong_phd_scenario1 {
 		auto node = std::dynamic_pointer_cast<phuong_node>(get_node());
 
 		node->on_self(entity::event_first_start, [this, node](event& ev) {
-			last_battery_update = get_reference_time();
+			auto now = get_reference_time();
+			last_battery_update = now;
 
-			timer(sampling_time, true, [this, node](event& ev) {
-				auto battery = node->get_battery();
+			// one timer per change of state instead of polling the schedule every minute
+			auto ltime = get_world_ptr()->get_reference_frame().get_calendar().to_civil(now);
+			double minutes = ltime.hour * 60. + ltime.minute + ltime.second / 60.;	// number of minutes since 00:00 of the day
 
-				auto now = get_reference_time();
+			double now_c = get_world_clock_time();
+			timeline = global_schedule.timeline(node->get_node_idx(), now_c, minutes, runtime_limit);
+			next_transition = 1;
 
-				battery->charge(sampling_time.count());
+			set_active(timeline[0].active);
 
-				if (battery->consume(chrono::duration_cast<chrono::duration<double>>(now - last_battery_update).count())) {
-					if (active) node->get_sensor()->measure();
-				}
+			timer_once(chrono::duration<double>(max(0., runtime_limit - now_c)), true, [node](event&) {
+				node->stop();
+			});
 
-				last_battery_update = now;
+			timer(sampling_time, true, [this, node](event& ev) {
+				if (active) node->get_sensor()->measure();
 			});
 		});
 
-		timer(1min, true, (std::function<bool(event&)>)[this, node](event& ev) -> bool {
-			try {
-				auto now = get_reference_time();
-				auto now_t = chrono::system_clock::to_time_t(now);
+		// the timeline is in world time: after a stop, the transitions missed meanwhile are
+		// caught up and the next one is armed for what is left until it, not a full delay
+		node->on_self(entity::event_start, [this](event& ev) {
+			last_battery_update = get_reference_time();	// nothing was drawn while stopped
 
-				tm ltime;
-				localtime_s(&ltime, &now_t);
-				double minutes = ltime.tm_hour * 60. + ltime.tm_min + ltime.tm_sec / 60.;	// number of minutes since 00:00 of the day
+			double now = get_world_clock_time();
+			bool a = active;
+			while (next_transition < timeline.size() && timeline[next_transition].time <= now)
+				a = timeline[next_transition++].active;
 
-				auto& schedule = global_schedule.node_schedules[node->get_node_idx()];
-				uint current_step = 0;
-				for (; current_step < schedule.size() - 1 && minutes > schedule[current_step + 1].start; current_step++);
+			set_active(a);
 
-				set_active(schedule[current_step].active);
+			arm_next_transition();
+			expect_battery_empty();
+		});
 
-				double now_c = get_world()->get_clock().reference2clock(now);
-				if (now_c > runtime_limit)
-					node->stop();
-			}
-			catch (...) {
-				cout << "----------------" << endl;
-				return false;
+		node->on_self(entity::event_stop, [this, node](event& ev) {
+			if (node->get_battery_t()->get_soc() > 0.) settle_battery();
+
+			stop_timer(transition_timer);
+			transition_timer = 0;
+		});
+	}
+
+	inline void phuong_controller::settle_battery()
+	{
+		auto battery = std::dynamic_pointer_cast<battery::chemical>(get_node()->get_battery());
+		auto step = chrono::duration_cast<chrono::system_clock::duration>(sampling_time);
+		auto now = get_reference_time();
+
+		while (now - last_battery_update >= step) {
+			last_battery_update += step;
+			battery->charge(sampling_time.count());
+
+			if (!battery->consume(sampling_time.count())) {
+				last_battery_update = now;
+				break;
 			}
+		}
+	}
+
+	inline void phuong_controller::expect_battery_empty()
+	{
+		// charging and consuming all the time, as the steps above do
+		auto battery = std::dynamic_pointer_cast<battery::chemical>(get_node()->get_battery());
+		battery->expect_empty(1., [](double) { return 1.; });
+	}
+
+	inline void phuong_controller::arm_next_transition()
+	{
+		if (transition_timer) stop_timer(transition_timer);
+		transition_timer = 0;
+
+		if (next_transition >= timeline.size()) return;
 
-			return true;
+		double dt = timeline[next_transition].time - get_world_clock_time();
+		transition_timer = timer_once(chrono::duration<double>(max(0., dt)), false, [this](event&) {
+			transition_timer = 0;
+			set_active(timeline[next_transition++].active);
+			arm_next_transition();
 		});
 	}
 
@@ -314,7 +397,7 @@ namespace test_phuong_phd_scenario1 {
 			}
 
 			sn->on(basic_sensor::event_measure, [](event& ev, std::any value, double time) {
-				auto n = dynamic_pointer_cast<phuong_node>( dynamic_pointer_cast<basic_sensor>(ev.target)->get_node() );
+				auto n = dynamic_pointer_cast<phuong_node>( ev.get_target<basic_sensor>()->get_node() );
 
 				lock_guard lock(writemx);
 				cout << format_time(n->get_reference_time()) << ": "
@@ -328,7 +411,7 @@ namespace test_phuong_phd_scenario1 {
 			});
 
 			sn->on(basic_node::event_start, [](event& ev) {
-				if (auto n = dynamic_pointer_cast<phuong_node>(ev.target); n) {
+				if (auto n = ev.get_target<phuong_node>(); n) {
 					lock_guard lock(writemx);
 					cout << format_time(n->get_reference_time()) << ": "
 						<< "Node " << n->get_name() << " (" << n->get_id() << ") started" << endl;
@@ -337,7 +420,7 @@ namespace test_phuong_phd_scenario1 {
 			});
 
 			sn->on(basic_node::event_stop, [](event& ev) {
-				if (auto n = dynamic_pointer_cast<phuong_node>(ev.target); n) {
+				if (auto n = ev.get_target<phuong_node>(); n) {
 					lock_guard lock(writemx);
 					cout << format_time(n->get_reference_time()) << ": "
 						<< "Node " << n->get_name() << " (" << n->get_id() << ") stopped" << endl;
@@ -345,14 +428,14 @@ namespace test_phuong_phd_scenario1 {
 			});
 
 			sn->on(phuong_controller::event_active, [](event& ev) {
-				auto n = dynamic_pointer_cast<phuong_controller>(ev.target)->get_node();
+				auto n = ev.get_target<phuong_controller>()->get_node();
 				lock_guard lock(writemx);
 				cout << format_time(n->get_reference_time()) << ": "
 					<< "Node " << n->get_name() << " (" << n->get_id() << ") is active" << endl;
 			});
 
 			sn->on(phuong_controller::event_inactive, [](event& ev) {
-				auto n = dynamic_pointer_cast<phuong_controller>(ev.target)->get_node();
+				auto n = ev.get_target<phuong_controller>()->get_node();
 				lock_guard lock(writemx);
 				cout << format_time(n->get_reference_time()) << ": "
 					<< "Node " << n->get_name() << " (" << n->get_id() << ") is inactive" << endl;
@@ -360,7 +443,7 @@ namespace test_phuong_phd_scenario1 {
 
 			sn->on(basic_battery::event_charge, [](event& ev, double d) {
 				lock_guard lock(writemx);
-				auto n = dynamic_pointer_cast<basic_battery>(ev.target)->get_node();
+				auto n = ev.get_target<basic_battery>()->get_node();
 				cout << format_time(n->get_reference_time()) << ": "
 					<< "Node " << n->get_name() << " (" << n->get_id() << ") charged, level = " << n->get_battery()->get_soc() << endl;
 				log_info(n);
@@ -368,14 +451,14 @@ namespace test_phuong_phd_scenario1 {
 
 			sn->on(basic_battery::event_consume, [](event& ev, double d) {
 				lock_guard lock(writemx);
-				auto n = dynamic_pointer_cast<basic_battery>(ev.target)->get_node();
+				auto n = ev.get_target<basic_battery>()->get_node();
 				cout << format_time(n->get_reference_time()) << ": "
 					<< "Node " << n->get_name() << " (" << n->get_id() << ") consumed, level = " << n->get_battery()->get_soc() << endl;
 				log_info(n);
 			});
 
 			sn->on(basic_battery::event_empty, [](event& ev) {
-				auto n = dynamic_pointer_cast<basic_battery>(ev.target)->get_node();
+				auto n = ev.get_target<basic_battery>()->get_node();
 				{
 					lock_guard lock(writemx);
 					cout << format_time(n->get_reference_time()) << ": "